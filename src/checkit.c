@@ -1,384 +1,765 @@
-/*  CHECKIT  
-    A file checksummer and integrity tester 
-    Copyright (C) 2014 Dennis Katsonis
-
-    This program is free software: you can redistribute it and/or modify
-    it under the terms of the GNU General Public License as published by
-    the Free Software Foundation, either version 3 of the License, or
-    (at your option) any later version.
-
-    This program is distributed in the hope that it will be useful,
-    but WITHOUT ANY WARRANTY; without even the implied warranty of
-    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
-    GNU General Public License for more details.
-
-    You should have received a copy of the GNU General Public License
-    along with this program.  If not, see <http://www.gnu.org/licenses/>.
-*/
-
-#include <string.h>
-#include <stdlib.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <sys/vfs.h>
-#include <fcntl.h>
-#include <stdio.h>
-#include <attr/xattr.h>
-#include <linux/limits.h>
-#include <sys/statfs.h>
-#include <stdint.h>
-#include <unistd.h>
-#include <errno.h>
-#include <libgen.h>
-
-#include "checkit.h"
-#include "fsmagic.h"
-
-const int MAX_BUF_LEN  = 65536;
-int processed = 0;
-int failed = 0;
-int nocrc = 0;
-
-const char* attributeName = "user.crc64";
-
-const char* errorMessage(int error)
-{ /* Standardised error messages. */
-  char *_error[] = {
-    "Success",
-    "Failed to calculate CRC from file.",
-    "Failed to remove extended attribute.",
-    "Could not store CRC.",
-    "Could not open directory.",
-    "Could not open file.",
-    "Could not read file.",
-    "Setting CRC failed.  Could not write attribute.",
-    "Could not remove hidden checksum file.",
-    "No extended attribute to export.",
-    "Can not overwrite existing checksum.",
-    "Could not write to file.",
-    "Filename too long."
-  };
-  return _error[error];
-}
-
-char* hiddenCRCFile(const char *file)
-{ /* Returns a string with the filename of the hidden CRC file */
-  static char crc_file[PATH_MAX - 1] = "\0";
-  char *base_filename;
-  char *dir_filename;
-  char *_filename;
-   
-  _filename = strdup(file);
-  
-  base_filename = basename(_filename);
-  dir_filename = dirname(_filename);  
-  sprintf(crc_file, "%s//.%s.crc64", dir_filename, base_filename);
-
-  free(_filename); /* It seems basename() and dirname() refer to this string,
-		    * so we cannot free it until we are done with the strings
-		    * it provides. */
-  return(crc_file);
-}
-
-static int fileExists(const char* file) {
-  struct stat buf;
-  return (stat(file, &buf) == 0);
-}
-
-int presentCRC64(const char *file)
-{  /* Check if CRC64 attribute is present. Returns XATTR if xattr, HIDDEN if hidden file. */
-  char buf[LIST_XATTR_BUFFER_SIZE];
-  char *current_attr = NULL;
-  int x;
-
-  x = listxattr(file,buf,LIST_XATTR_BUFFER_SIZE);
-  current_attr = buf;    
-  if (x != -1)
-  {
-  do {
-      if (strcmp(current_attr, attributeName) == 0)
-      {    
-          return XATTR;
-      }
-      else
-      {
-        current_attr += (strlen(current_attr) + 1);
-      }
-      
-    } while ((current_attr - buf) < x);
-  }
-  /* No attribute?  Lets look for an existing hidden file. */
-
-  if (fileExists(hiddenCRCFile(file)))
-    return HIDDEN_ATTR;
-
-  errno = 0; /* Clear errno from any previous issue. We will be printing
-	      * an error message, but it is not related to any previous error
-	      * encountered (such as not finding the hidden CRC file. */
-
- return 0;    
-}
-
-
-int exportCRC(const char *filename, int flags)
-{
-  int file_handle;
-  fileCRC result;
-
-  if (presentCRC64(filename) != XATTR)
-    return ERROR_NO_XATTR; /* No extended attribute to export. */
-    
-  if (fileExists(hiddenCRCFile(filename)) && (!(flags & OVERWRITE)))
-    return ERROR_NO_OVERWRITE; /* Don't overwrite attribute unless allowed. */
-
-  if ((file_handle = open(hiddenCRCFile(filename), O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR)) == -1)
-    return ERROR_OPEN_FILE;
-  
-  result = getCRC(filename);
-  if(result.status != SUCCESS) /* If 0 returned (error), return with error being we couldn't read the file.
-	      * perror will print more detail. */
-    return ERROR_READ_FILE;
-  
-  write(file_handle, &crc64, sizeof (t_crc64));
-  close(file_handle);
-
-  if ((removexattr(filename, attributeName)) == -1)
-    return ERROR_REMOVE_XATTR;
-  
-  return SUCCESS;
-}
-  
-int removeCRC(const char *filename)
-{ /* Removes CRC, either the xattr, hidden file, or both */
-  if (presentCRC64(filename) == XATTR)
-  {
-    if ((removexattr(filename, attributeName)) == -1)
-      return ERROR_REMOVE_XATTR;
-  }
-  if (presentCRC64(filename) == HIDDEN_ATTR)
-    if ((unlink(hiddenCRCFile(filename)) == -1) && VERBOSE)
-      return ERROR_REMOVE_HIDDEN;
-
-  return SUCCESS;
-}
-
-int importCRC(const char *filename, int flags)
-{
-  int file_handle;
-  t_crc64 crc64;
-  int ATTRFLAGS;
-      
-  ATTRFLAGS = (flags & OVERWRITE) ? 0 : XATTR_CREATE;
-  
-  if ((presentCRC64(filename) != HIDDEN_ATTR) && (flags & OVERWRITE))
-    return ERROR_NO_OVERWRITE;
-  
-  if ((file_handle = open(hiddenCRCFile(filename), O_RDONLY)) == -1)
-    return ERROR_OPEN_FILE;
-  
-  read(file_handle, &crc64, sizeof (t_crc64));
-  close(file_handle);
-  if ((setxattr(filename, attributeName, (const char *)&crc64, sizeof(crc64), ATTRFLAGS)) == -1)
-    return ERROR_SET_CRC;
-
-  unlink(hiddenCRCFile(filename));
-
-  return SUCCESS;
-}
-
-fileCRC FileCRC64(const char *filename)
-{ /* Open file and calcuate CRC.  Returns 0 on failure, otherwise returns the CRC. */
-  unsigned char buf[MAX_BUF_LEN];
-  size_t bufread = MAX_BUF_LEN;
-  int cont = 1;
-  int fd;
-  uint64_t tot = 0;
-  uint64_t temp = 0;
-  fileCRC crcResult;
-  
-  if ((fd = open(filename,O_RDONLY)) == -1)
-  {
-    crcResult.status = ERROR_CRC_CALC;
-    return crcResult; 
-  }
-  
-  while (cont)
-  {
-    bufread = read(fd, buf, bufread);
-      if (bufread == -1)
-      {
-	close(fd);
-        crcResult.status = ERROR_CRC_CALC;
-        return crcResult; 
-      }
-    temp =  (t_crc64) crc64(temp, buf, (unsigned int)bufread);
-    tot = tot + bufread;
-    if (bufread < MAX_BUF_LEN)
-      cont = 0;
-  }
-
-  close(fd);
-  crcResult.status = SUCCESS;
-  crcResult.crc64 = temp;
- 
-  return crcResult;
-}
-
-int putCRC(const char *file, int flags)
-{     
-  fileCRC checksum_file;
-  fileCRC oldCRC;
-
-  int file_handle;
-  int ATTRFLAGS;
-  int fstype;
-  fstype = getfsType(file);
-
-  ATTRFLAGS = (flags & OVERWRITE) ? 0 : XATTR_CREATE;
-
-  oldCRC = getCRC(file);      
-  
-  /* Lets see if there is an existing CRC, if so get it. */
-  if ((oldCRC.status != SUCCESS) && (oldCRC.status != ERROR_NO_XATTR))
-  {
-    return oldCRC.status;
-  }
-  /* If there is, and we aren't overwriting, bail out. */
-  if ((oldCRC.status == SUCCESS) && !(flags & OVERWRITE))
-    {
-      return ERROR_NO_OVERWRITE;
-    }
-  
-  checksum_file = FileCRC64(file);
-
-  if (checksum_file.status != SUCCESS)
-  {
-    return checksum_file.status;
-  }
-
-  if ((checksum_file.crc64 != oldCRC.crc64) && (oldCRC.status == SUCCESS))
-  {
-    /* If we have a valid checksum for the file already, notify if the new checksum is different. */
-    printf("File %s has been changed since checksum last computed!\n", file);
-  }
-  
-  if(fstype != VFAT && fstype != UDF && fstype != NFS)
-  { /* If not VFAT or UDF or NFS, attempt to store CRC in extended attribute */
-    if ((setxattr(file, attributeName, (const char *)&checksum_file.crc64, sizeof(checksum_file.crc64), ATTRFLAGS)) == -1)
-    {
-      return ERROR_SET_CRC;
-    }
-    else
-    {
-      return SUCCESS; /* And we're done here, return to process next file */
-    }
-  } 
-
-  if ((file_handle = open(hiddenCRCFile(file), O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR)) == -1)
-    return ERROR_OPEN_FILE;
-  if (write(file_handle, &checksum_file.crc64, sizeof (t_crc64)) == -1)
-    return ERROR_WRITE_FILE;
-
-  close(file_handle);
-  if(fstype == VFAT) /* Set hidden flag for VFAT */
-    vfat_attr(hiddenCRCFile(file));
-  else if (fstype == NTFS) /* or NTFS */
-    ntfs_attr(hiddenCRCFile(file));
-
-  return SUCCESS;
-}
-
-fileCRC getCRC(const char *file)
-{ /* This retreives the CRC, first by checking for an extended attribute
-    then by looking for a hidden file.  Returns 0 if unsuccessful, otherwise
-    return the checksum.*/
-  int attribute_format;
-  t_crc64 checksum_attr;
-  int file_handle;
-  fileCRC crcResult;
-    
-  attribute_format = presentCRC64(file);
-
-  if (attribute_format == 0)
-  {  
-    crcResult.status = ERROR_NO_XATTR;
-    return crcResult;
-  }
-
-  if (attribute_format == XATTR)
-  {
-    if (getxattr(file, attributeName, (char *)&checksum_attr, sizeof(t_crc64)) == -1)
-    {
-      crcResult.status = ERROR_CRC_CALC;
-      return crcResult;
-    }
-    else
-    {
-      crcResult.status = SUCCESS;
-      crcResult.crc64 = checksum_attr;
-      return crcResult;
-    }
-  }
-  if (attribute_format == HIDDEN_ATTR)
-  {
-    if ((file_handle = open(hiddenCRCFile(file), O_RDONLY)) == -1)
-    {
-      crcResult.status = ERROR_CRC_CALC;
-      return crcResult;
-    }
-    if (read(file_handle, &checksum_attr, sizeof(t_crc64)) == -1)
-    {
-      perror("Failure reading hidden checksum file.");
-      crcResult.status = ERROR_READ_FILE;
-      crcResult.crc64 = 0;
-      return crcResult;
-    }
-    crcResult.status = SUCCESS;
-    crcResult.crc64 = checksum_attr;
-    return crcResult;
-  }
-  crcResult.status = ERROR_CRC_CALC;
-  return crcResult;
-}
-
-int getfsType(const char *file)
-{
-  int fstype;
-  struct statfs sstat;
-  
-  statfs(file, &sstat);
-  switch (sstat.f_type)
-    {
-    case MSDOS_SUPER_MAGIC:
-      fstype = VFAT;
-      break;
-    case NTFS_SUPER_MAGIC:
-      fstype = NTFS;
-      break;
-    case UDF_SUPER_MAGIC:
-      fstype = UDF;
-      break;
-    case XFS_SUPER_MAGIC:
-      fstype = XFS;
-      break;
-    case JFS_SUPER_MAGIC:
-      fstype = JFS;
-      break;
-    case NFS_SUPER_MAGIC:
-      fstype = NFS;
-      break;
-    case SMB_SUPER_MAGIC:
-      fstype = SMB;
-      break;
-    case BTRFS_TEST_MAGIC:
-      fstype = BTRFS;
-      break;
-    case BTRFS_SUPER_MAGIC:
-      fstype = BTRFS;
-      break;
-    default:
-      fstype = 0;
-      break;
-    }
-  return fstype;
-}
+/*  CHECKIT  
+    A file checksummer and integrity tester 
+    Copyright (C) 2014 Dennis Katsonis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE /* SEEK_DATA and SEEK_HOLE */
+#include <string.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <attr/xattr.h>
+#include <linux/limits.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "checkit.h"
+#include "checkit_fs.h"
+#include "checkit_io.h"
+#include "checkit_throttle.h"
+#include "checkit_progress.h"
+#include "checkit_blockmap.h"
+#include "checkit_dedup.h"
+
+const int MAX_BUF_LEN  = 65536;
+int processed = 0;
+int failed = 0;
+int nocrc = 0;
+int changed = 0;
+int hashThreads = 1; /* Threads used to hash a single large file. */
+
+const char* attributeName = "user.crc64";
+const char* fingerprintName = "user.crc64.fingerprint";
+
+const char* errorMessage(int error)
+{ /* Standardised error messages. */
+  char *_error[] = {
+    "Success",
+    "Failed to calculate CRC from file.",
+    "Failed to remove extended attribute.",
+    "Could not store CRC.",
+    "Could not open directory.",
+    "Could not open file.",
+    "Could not read file.",
+    "Setting CRC failed.  Could not write attribute.",
+    "Could not remove hidden checksum file.",
+    "No extended attribute to export.",
+    "Can not overwrite existing checksum.",
+    "Could not write to file.",
+    "Filename too long.",
+    "Out of memory."
+  };
+  if (error < 0 || error >= (int)(sizeof(_error) / sizeof(_error[0])))
+    return "Unknown error.";
+  return _error[error];
+}
+
+int openFileHandle(fileHandle *file, int dirfd, const char *name, const char *path)
+{ /* Open a file once, for everything we do to it.  O_NONBLOCK stops us
+   * hanging if the file has been replaced by a FIFO since it was found. */
+  file->path = path;
+  file->dirfd = dirfd;
+  file->name = name;
+  file->hidden[0] = 0;
+  file->fd = openat(dirfd, name, O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+  if (file->fd == -1)
+    return ERROR_OPEN_FILE;
+  if (fstat(file->fd, &file->statbuf) == -1)
+  {
+    closeFileHandle(file);
+    return ERROR_OPEN_FILE;
+  }
+  file->fs = lookupFs(file->fd, file->statbuf.st_dev);
+  return SUCCESS;
+}
+
+void closeFileHandle(fileHandle *file)
+{
+  if (file->fd != -1)
+    close(file->fd);
+  file->fd = -1;
+}
+
+const char* hiddenCRCFile(fileHandle *file)
+{ /* Returns the filename of the hidden CRC file, relative to the same
+   * directory as the file itself.  Worked out once per file. */
+  const char *base_filename;
+  int dirlen;
+
+  if (file->hidden[0] == 0)
+  {
+    base_filename = strrchr(file->name, '/');
+    base_filename = (base_filename == NULL) ? file->name : base_filename + 1;
+    dirlen = base_filename - file->name;
+    snprintf(file->hidden, sizeof(file->hidden), "%.*s.%s.crc64", dirlen, file->name, base_filename);
+  }
+  return file->hidden;
+}
+
+static int hiddenExists(fileHandle *file)
+{
+  return (faccessat(file->dirfd, hiddenCRCFile(file), F_OK, 0) == 0);
+}
+
+static int noAttribute(int error)
+{ /* Does this error from f*xattr() just mean there is no attribute? */
+  return ((error == ENODATA) || (error == ENOTSUP) || (error == ENOSYS));
+}
+
+static int64_t nanoseconds(const struct timespec *t)
+{
+  return (int64_t)t->tv_sec * 1000000000LL + t->tv_nsec;
+}
+
+static int64_t wallClock(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  return nanoseconds(&now);
+}
+
+static void makeFingerprint(fileHandle *file, fileFingerprint *fingerprint)
+{ /* The file as it was when we opened it.  Storing an attribute moves
+   * ctime to about now, so when we stored it is kept too.  The coarse
+   * clock is the one the kernel stamps ctime with.  What the CRC covers,
+   * and when it was verified, are left to the caller. */
+  struct timespec now;
+
+  clock_gettime(CLOCK_REALTIME_COARSE, &now);
+  fingerprint->size = file->statbuf.st_size;
+  fingerprint->mtime = nanoseconds(&file->statbuf.st_mtim);
+  fingerprint->ctime = nanoseconds(&file->statbuf.st_ctim);
+  fingerprint->stored = nanoseconds(&now);
+  fingerprint->inode = file->statbuf.st_ino;
+}
+
+int fingerprintMatches(fileHandle *file, const fileFingerprint *fingerprint)
+{ /* Does the file look the same as when its checksum was stored?  ctime
+   * will have moved if we stored the checksum in an attribute, but only
+   * to about when we did. */
+  int64_t ctime = nanoseconds(&file->statbuf.st_ctim);
+
+  return ((fingerprint->size == (uint64_t)file->statbuf.st_size) &&
+	  (fingerprint->mtime == nanoseconds(&file->statbuf.st_mtim)) &&
+	  (fingerprint->inode == (uint64_t)file->statbuf.st_ino) &&
+	  ((fingerprint->ctime == ctime) ||
+	   (llabs(ctime - fingerprint->stored) <= FINGERPRINT_SLACK)));
+}
+
+static int freshFingerprint(fileHandle *file, fileFingerprint *fingerprint)
+{ /* If the stored fingerprint still matches, a new one to store with the
+   * checksum wherever it moves to. */
+  if ((getFingerprint(file, fingerprint) != SUCCESS) || !fingerprintMatches(file, fingerprint))
+    return 0;
+  makeFingerprint(file, fingerprint);
+  return 1;
+}
+
+static int sampleCRC(fileHandle *file, uint64_t length, uint64_t *crc)
+{ /* CRC of the last APPEND_SAMPLE bytes of the first length bytes. */
+  crcRange range;
+
+  range.fd = file->fd;
+  range.length = (length < APPEND_SAMPLE) ? length : APPEND_SAMPLE;
+  range.start = length - range.length;
+  rangeCRC64(&range);
+  *crc = range.crc;
+  return ((range.status == SUCCESS) && ((uint64_t)range.length == length - range.start)) ? SUCCESS : ERROR_READ_FILE;
+}
+
+static int appended(fileHandle *file, const fileFingerprint *fingerprint)
+{ /* Has the file only grown since its checksum was stored?  The end of
+   * what was there then is read again, to make sure it hasn't changed. */
+  uint64_t tail;
+
+  return ((fingerprint->inode == (uint64_t)file->statbuf.st_ino) &&
+	  ((uint64_t)file->statbuf.st_size > fingerprint->length) &&
+	  (sampleCRC(file, fingerprint->length, &tail) == SUCCESS) && (tail == fingerprint->tail));
+}
+
+static fileCRC appendCRC(fileHandle *file, t_crc64 crc, uint64_t length)
+{ /* Carry on the CRC of the first length bytes over the rest. */
+  crcRange range;
+  fileCRC crcResult;
+
+  range.fd = file->fd;
+  range.start = length;
+  range.length = file->statbuf.st_size - length;
+  rangeCRC64(&range);
+  crcResult.status = range.status;
+  crcResult.crc64 = crc64_combine(crc, range.crc, range.length);
+  crcResult.length = length + range.length;
+  return crcResult;
+}
+
+static int writeHidden(fileHandle *file, t_crc64 crc, const fileFingerprint *fingerprint)
+{ /* Store the checksum, and the fingerprint if given after it, in the
+   * hidden file. */
+  int file_handle;
+  int result = SUCCESS;
+  int fstype = getfsType(file);
+
+  if ((file_handle = openat(file->dirfd, hiddenCRCFile(file), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR)) == -1)
+    return ERROR_OPEN_FILE;
+  if ((write(file_handle, &crc, sizeof(t_crc64)) != sizeof(t_crc64)) ||
+      ((fingerprint != NULL) &&
+       (write(file_handle, fingerprint, sizeof(fileFingerprint)) != sizeof(fileFingerprint))))
+    result = ERROR_WRITE_FILE;
+
+  if (fstype == VFAT) /* Set hidden flag for VFAT */
+    vfat_attr(file_handle);
+  else if (fstype == NTFS) /* or NTFS */
+    ntfs_attr(file_handle);
+  close(file_handle);
+  return result;
+}
+
+int presentCRC64(fileHandle *file)
+{  /* Check if CRC64 attribute is present. Returns XATTR if xattr, HIDDEN if hidden file. */
+  t_crc64 checksum_attr;
+
+  if (fsHasXattr(file->fs) &&
+      ((fgetxattr(file->fd, attributeName, &checksum_attr, sizeof(checksum_attr)) != -1) ||
+       (errno == ERANGE)))
+    return XATTR;
+
+  /* No attribute?  Lets look for an existing hidden file. */
+  if (hiddenExists(file))
+    return HIDDEN_ATTR;
+
+  errno = 0; /* Clear errno from any previous issue. We will be printing
+	      * an error message, but it is not related to any previous error
+	      * encountered (such as not finding the hidden CRC file. */
+
+ return 0;    
+}
+
+
+int exportCRC(fileHandle *file, int flags)
+{
+  t_crc64 checksum_attr;
+  fileFingerprint fingerprint;
+  int result;
+
+  if (fgetxattr(file->fd, attributeName, &checksum_attr, sizeof(checksum_attr)) != sizeof(checksum_attr))
+    return ERROR_NO_XATTR; /* No extended attribute to export. */
+    
+  if (hiddenExists(file) && (!(flags & OVERWRITE)))
+    return ERROR_NO_OVERWRITE; /* Don't overwrite attribute unless allowed. */
+
+  result = writeHidden(file, checksum_attr, freshFingerprint(file, &fingerprint) ? &fingerprint : NULL);
+  if (result != SUCCESS)
+    return result;
+
+  if ((fremovexattr(file->fd, attributeName)) == -1)
+    return ERROR_REMOVE_XATTR;
+  if ((fremovexattr(file->fd, fingerprintName) == -1) && !noAttribute(errno))
+    return ERROR_REMOVE_XATTR;
+  
+  return SUCCESS;
+}
+  
+int removeCRC(fileHandle *file)
+{ /* Removes CRC, either the xattr, hidden file, or both */
+  if ((fremovexattr(file->fd, attributeName) == -1) && !noAttribute(errno))
+    return ERROR_REMOVE_XATTR;
+  if ((fremovexattr(file->fd, fingerprintName) == -1) && !noAttribute(errno))
+    return ERROR_REMOVE_XATTR;
+
+  if ((unlinkat(file->dirfd, hiddenCRCFile(file), 0) == -1) && (errno != ENOENT))
+    return ERROR_REMOVE_HIDDEN;
+
+  return removeBlockMap(file);
+}
+
+int importCRC(fileHandle *file, int flags)
+{
+  int file_handle;
+  t_crc64 crc64;
+  fileFingerprint fingerprint;
+  int fingerprinted;
+  int ATTRFLAGS;
+      
+  ATTRFLAGS = (flags & OVERWRITE) ? 0 : XATTR_CREATE;
+  
+  if ((presentCRC64(file) != HIDDEN_ATTR) && (flags & OVERWRITE))
+    return ERROR_NO_OVERWRITE;
+  
+  if ((file_handle = openat(file->dirfd, hiddenCRCFile(file), O_RDONLY | O_CLOEXEC)) == -1)
+    return ERROR_OPEN_FILE;
+  
+  if (read(file_handle, &crc64, sizeof (t_crc64)) != sizeof(t_crc64))
+  {
+    close(file_handle);
+    return ERROR_READ_FILE;
+  }
+  close(file_handle);
+  fingerprinted = freshFingerprint(file, &fingerprint);
+  if ((fsetxattr(file->fd, attributeName, (const char *)&crc64, sizeof(crc64), ATTRFLAGS)) == -1)
+    return ERROR_SET_CRC;
+  if (fingerprinted &&
+      (fsetxattr(file->fd, fingerprintName, (const char *)&fingerprint, sizeof(fingerprint), 0) == -1))
+    return ERROR_SET_CRC;
+
+  unlinkat(file->dirfd, hiddenCRCFile(file), 0);
+
+  return SUCCESS;
+}
+
+static off_t nextData(int fd, off_t pos, off_t end, off_t *dataEnd)
+{ /* Where the next data at or after pos starts, and in dataEnd where it
+   * stops, both no further than end.  Where lseek() can't tell us, it is
+   * all data. */
+  off_t data;
+  off_t hole;
+
+  *dataEnd = end;
+  if ((data = lseek(fd, pos, SEEK_DATA)) == -1)
+  { /* ENXIO means no more data.  The rest up to the file's size is a
+     * hole.  Past the size, reading finds the file shrunk. */
+    if ((errno != ENXIO) || ((data = lseek(fd, 0, SEEK_END)) < pos))
+      return pos;
+    return (data < end) ? data : end;
+  }
+  if (data >= end)
+    return end;
+  if (((hole = lseek(fd, data, SEEK_HOLE)) != -1) && (hole < end))
+    *dataEnd = hole;
+  return data;
+}
+
+void *rangeCRC64(void *arg)
+{ /* Calculate the CRC of one range of a file, using pread so that
+   * several threads can share the file descriptor.  Holes in sparse
+   * files aren't read.  The CRC is moved over their zeros with
+   * crc64_shift() instead. */
+  crcRange *range = arg;
+  unsigned char buf[MAX_BUF_LEN];
+  off_t pos = range->start;
+  off_t end = range->start + range->length;
+  off_t dataEnd = pos;		/* End of the data we are reading */
+  off_t data;
+  ssize_t bufread;
+  size_t want;
+  double start;
+
+  range->crc = 0;
+  range->status = SUCCESS;
+  while (pos < end)
+  {
+    if (pos >= dataEnd)
+    { /* Skip any hole up to the next data */
+      data = nextData(range->fd, pos, end, &dataEnd);
+      range->crc = crc64_shift(range->crc, data - pos);
+      progressBytes(data - pos);
+      pos = data;
+      continue;
+    }
+    want = (dataEnd - pos) < MAX_BUF_LEN ? (size_t)(dataEnd - pos) : MAX_BUF_LEN;
+    throttleIO(want);
+    start = ioStart();
+    bufread = pread(range->fd, buf, want, pos);
+    ioEnd(start);
+    if (bufread == -1)
+    {
+      if (errno == EINTR)
+	continue;
+      range->status = ERROR_CRC_CALC;
+      break;
+    }
+    if (bufread == 0)
+      break; /* File shrunk underneath us. */
+    range->crc = crc64(range->crc, buf, bufread);
+    progressBytes(bufread);
+    pos += bufread;
+  }
+  range->length = pos - range->start;
+  return NULL;
+}
+
+static int parallelCRC64(int fd, off_t size, uint64_t *crc, off_t *done)
+{ /* Split the first size bytes of the file into one range per thread,
+   * hash them concurrently and merge the results with crc64_combine().
+   * Returns SUCCESS with the CRC and the number of bytes covered. */
+  crcRange range[MAX_HASH_THREADS];
+  pthread_t thread[MAX_HASH_THREADS];
+  int started[MAX_HASH_THREADS];
+  off_t chunk;
+  off_t pos = 0;
+  int threads = hashThreads;
+  int status = SUCCESS;
+  int i;
+
+  if (threads > MAX_HASH_THREADS)
+    threads = MAX_HASH_THREADS;
+  /* Ranges are whole multiples of the read size. */
+  chunk = ((size / threads) + MAX_BUF_LEN - 1) / MAX_BUF_LEN * MAX_BUF_LEN;
+
+  for (i = 0; i < threads; i++)
+  {
+    range[i].fd = fd;
+    range[i].start = pos;
+    range[i].length = (size - pos) < chunk ? (size - pos) : chunk;
+    pos += range[i].length;
+    started[i] = (i > 0) && (pthread_create(&thread[i], NULL, rangeCRC64, &range[i]) == 0);
+  }
+  rangeCRC64(&range[0]); /* This thread does the first range. */
+  for (i = 1; i < threads; i++)
+  {
+    if (started[i])
+      pthread_join(thread[i], NULL);
+    else
+      rangeCRC64(&range[i]);
+  }
+
+  *crc = 0;
+  *done = 0;
+  for (i = 0; i < threads; i++)
+  {
+    if (range[i].status != SUCCESS)
+      status = range[i].status;
+    *crc = crc64_combine(*crc, range[i].crc, range[i].length);
+    *done += range[i].length;
+    if (range[i].start + range[i].length != (i + 1 < threads ? range[i + 1].start : size))
+      break; /* Short range, file was truncated.  Stop at the gap. */
+  }
+  return status;
+}
+
+fileCRC FileCRC64(fileHandle *file)
+{ /* Calcuate CRC of an open file.  Reads with pread, so the file offset
+   * does not matter. */
+  unsigned char stackbuf[MAX_BUF_LEN];
+  unsigned char *buf = stackbuf;
+  size_t buflen = MAX_BUF_LEN;
+  ssize_t bufread;
+  off_t pos = 0;
+  uint64_t temp = 0;
+  off_t dropped = 0;
+  double start;
+  fileCRC crcResult;
+  crcRange range;
+  const struct stat *statbuf = &file->statbuf;
+  int parallel = (hashThreads > 1) && S_ISREG(statbuf->st_mode) &&
+    (statbuf->st_size >= PARALLEL_HASH_MIN_SIZE);
+  int sparse = 0;
+  int direct = 0;
+  off_t hole;
+
+  if (!parallel && S_ISREG(statbuf->st_mode) && (statbuf->st_size > 0))
+  { /* -1 if the filesystem can't tell us, so read it as usual */
+    hole = lseek(file->fd, 0, SEEK_HOLE);
+    sparse = (hole != -1) && (hole < statbuf->st_size);
+  }
+
+  if (scrubIO && S_ISREG(statbuf->st_mode))
+  { /* Scrubbing.  Go around the page cache if we can, otherwise
+     * drop what we read from it as we go. */
+    posix_fadvise(file->fd, 0, 0, POSIX_FADV_NOREUSE);
+    direct = !parallel && !sparse && (ioMode != IO_MMAP) && (setDirect(file->fd, 1) == 0);
+  }
+
+  if (parallel)
+  { /* Large file, hash ranges of it in parallel.  Anything past the size
+     * we saw (if the file is growing) is picked up by the loop below. */
+    if (parallelCRC64(file->fd, statbuf->st_size, &temp, &pos) != SUCCESS)
+    {
+      crcResult.status = ERROR_CRC_CALC;
+      return crcResult;
+    }
+  }
+  else if (sparse)
+  { /* Has holes.  Only read the data, and step the CRC over the holes. */
+    range.fd = file->fd;
+    range.start = 0;
+    range.length = statbuf->st_size;
+    rangeCRC64(&range);
+    if (range.status != SUCCESS)
+    {
+      crcResult.status = ERROR_CRC_CALC;
+      return crcResult;
+    }
+    temp = range.crc;
+    pos = range.length;
+  }
+  else if ((ioMode == IO_URING) && S_ISREG(statbuf->st_mode) &&
+	   (statbuf->st_size > IO_URING_CHUNK))
+  { /* Keep several reads in flight.  Whatever it doesn't get to is read below. */
+    uringCRC64(file->fd, statbuf->st_size, &temp, &pos);
+  }
+  else if ((ioMode == IO_MMAP) && S_ISREG(statbuf->st_mode) && file->fs->mmapOk &&
+	   (statbuf->st_size >= MMAP_MIN_SIZE))
+  { /* Hash the page cache in place, rather than copying it out. */
+    mmapCRC64(file->fd, statbuf->st_size, &temp, &pos);
+  }
+  else if (direct)
+    directCRC64(file->fd, &temp, &pos);
+  if (direct)
+    setDirect(file->fd, 0); /* The rest, if any, is read normally */
+  
+  /* Read in the filesystem's preferred size, if it wants more than usual. */
+  if ((file->fs->ioSize > buflen) && (file->fs->ioSize <= MAX_IO_SIZE) &&
+      ((buf = malloc(file->fs->ioSize)) != NULL))
+    buflen = file->fs->ioSize;
+  else
+    buf = stackbuf;
+
+  for (;;)
+  {
+    throttleIO(buflen);
+    start = ioStart();
+    bufread = pread(file->fd, buf, buflen, pos);
+    ioEnd(start);
+    if (bufread == -1)
+    {
+      if (errno == EINTR)
+	continue;
+      break;
+    }
+    if (bufread == 0)
+      break;
+    temp =  (t_crc64) crc64(temp, buf, bufread);
+    progressBytes(bufread);
+    pos += bufread;
+    if (scrubIO && (pos - dropped >= SCRUB_DROP))
+    {
+      posix_fadvise(file->fd, dropped, pos - dropped, POSIX_FADV_DONTNEED);
+      dropped = pos;
+    }
+  }
+  if (buf != stackbuf)
+    free(buf);
+  if (scrubIO)
+    posix_fadvise(file->fd, 0, 0, POSIX_FADV_DONTNEED);
+  if (bufread == -1)
+  {
+    crcResult.status = ERROR_CRC_CALC;
+    return crcResult; 
+  }
+
+  crcResult.status = SUCCESS;
+  crcResult.crc64 = temp;
+  crcResult.length = pos;
+ 
+  return crcResult;
+}
+
+static int storeCRC(fileHandle *file, const fileCRC *checksum, int sameCRC, int ATTRFLAGS, int64_t verified)
+{ /* Store the CRC with a new fingerprint. */
+  fileFingerprint fingerprint;
+  t_crc64 crc = checksum->crc64;
+
+  makeFingerprint(file, &fingerprint);
+  fingerprint.verified = verified;
+  fingerprint.length = checksum->length;
+  if (checksum->length <= APPEND_SAMPLE)
+    fingerprint.tail = crc;
+  else if (sampleCRC(file, checksum->length, &fingerprint.tail) != SUCCESS)
+    fingerprint.tail = ~crc; /* Won't match, so it can't be appended to */
+  if (fsHasXattr(file->fs))
+  { /* If not VFAT or UDF or NFS, and the mount allows it, attempt to store CRC in extended attribute.
+     * An unchanged CRC is left alone, and only the fingerprint is updated. */
+    if ((sameCRC ||
+	 (fsetxattr(file->fd, attributeName, (const char *)&crc, sizeof(crc), ATTRFLAGS) != -1)) &&
+	(fsetxattr(file->fd, fingerprintName, (const char *)&fingerprint, sizeof(fingerprint), 0) != -1))
+      return SUCCESS; /* And we're done here, return to process next file */
+    if (errno != ENOTSUP)
+      return ERROR_SET_CRC;
+    fsNoXattr(file->fs); /* Use hidden files from now on */
+  } 
+
+  return writeHidden(file, crc, &fingerprint);
+}
+
+int markVerified(fileHandle *file, const fileCRC *checksum)
+{ /* The file's data has just been found to match its CRC.  Note when, in
+   * a new fingerprint, as the file is what it was when the CRC was made. */
+  return storeCRC(file, checksum, 1, 0, wallClock());
+}
+
+int putCRC(fileHandle *file, int flags, FILE *out)
+{     
+  fileCRC checksum_file;
+  fileCRC oldCRC;
+  fileFingerprint fingerprint;
+  blockMap map;
+  blockMap oldMap;
+  int mapped;
+  int haveFingerprint;
+  int fingerprinted;		/* The stored fingerprint still matches */
+  int appending;		/* The file has only grown since */
+  int sameCRC;
+  int result = SUCCESS;
+  int ATTRFLAGS;
+
+  ATTRFLAGS = (flags & OVERWRITE) ? 0 : XATTR_CREATE;
+  oldMap.crc = NULL;
+  oldMap.hashed = NULL;
+
+  oldCRC = getCRC(file);      
+  
+  /* Lets see if there is an existing CRC, if so get it. */
+  if ((oldCRC.status != SUCCESS) && (oldCRC.status != ERROR_NO_XATTR))
+  {
+    return oldCRC.status;
+  }
+  /* If there is, and we aren't overwriting, bail out. */
+  if ((oldCRC.status == SUCCESS) && !(flags & OVERWRITE))
+    {
+      return ERROR_NO_OVERWRITE;
+    }
+
+  mapped = (flags & BLOCKMAP) && wantBlockMap(file);
+  haveFingerprint = (oldCRC.status == SUCCESS) && (getFingerprint(file, &fingerprint) == SUCCESS);
+  fingerprinted = haveFingerprint && fingerprintMatches(file, &fingerprint);
+  if (fingerprinted && (flags & QUICK) && (!mapped || hasBlockMap(file)))
+  { /* Unchanged since it was stored, so don't read it */
+    progressBytes(file->statbuf.st_size);
+    return SUCCESS;
+  }
+  appending = (flags & APPEND) && haveFingerprint && !fingerprinted && appended(file, &fingerprint);
+  if (appending) /* Only the end of what was there is read again */
+    progressBytes(fingerprint.length - ((fingerprint.length < APPEND_SAMPLE) ? fingerprint.length : APPEND_SAMPLE));
+  
+  if (mapped)
+  { /* Hash it a block at a time, and put the blocks together for the CRC.
+     * If it has grown, the stored map's whole blocks are kept. */
+    if (appending && (getBlockMap(file, &oldMap) == SUCCESS) && (oldMap.header.size == fingerprint.length))
+      checksum_file.status = extendBlocks(file, &map, &oldMap, &checksum_file.crc64);
+    else
+      checksum_file.status = hashBlocks(file, &map, NULL, 0, &checksum_file.crc64);
+    checksum_file.length = map.header.size;
+    freeBlockMap(&oldMap);
+    if (checksum_file.status != SUCCESS)
+      freeBlockMap(&map);
+  }
+  else if (appending)
+    checksum_file = appendCRC(file, oldCRC.crc64, fingerprint.length);
+  else
+    checksum_file = sharedCRC64(file, flags);
+
+  if (checksum_file.status != SUCCESS)
+  {
+    return checksum_file.status;
+  }
+
+  sameCRC = (oldCRC.status == SUCCESS) && (checksum_file.crc64 == oldCRC.crc64);
+  if (!sameCRC && (oldCRC.status == SUCCESS) && !appending)
+  {
+    /* If we have a valid checksum for the file already, notify if the new checksum is different. */
+    fprintf(out, "File %s has been changed since checksum last computed!\n", file->path);
+  }
+  if (mapped)
+  { /* A new map moves ctime, so the fingerprint is renewed after it */
+    if (!sameBlockMap(file, &map))
+    {
+      result = putBlockMap(file, &map);
+      fingerprinted = 0;
+    }
+    freeBlockMap(&map);
+  }
+  else if (!sameCRC && hasBlockMap(file))
+  { /* A map of the old data would fail the new. */
+    result = removeBlockMap(file);
+    fingerprinted = 0;
+  }
+  /* Nothing new to store if it is the same, and rewriting it would only move ctime */
+  if ((result == SUCCESS) && (!sameCRC || !fingerprinted))
+    result = storeCRC(file, &checksum_file, sameCRC, ATTRFLAGS,
+		      appending ? fingerprint.verified : wallClock());
+  return result;
+}
+
+fileCRC getCRC(fileHandle *file)
+{ /* This retreives the CRC, first by reading the extended attribute
+    then by looking for a hidden file.  A missing attribute is just
+    ENODATA, so there is no need to list the attributes first. */
+  t_crc64 checksum_attr;
+  int file_handle;
+  ssize_t x;
+  fileCRC crcResult;
+    
+  if (!fsHasXattr(file->fs))
+  {
+    x = -1;
+    errno = ENOTSUP;
+  }
+  else
+    x = fgetxattr(file->fd, attributeName, (char *)&checksum_attr, sizeof(t_crc64));
+  if (x == sizeof(t_crc64))
+  {
+    crcResult.status = SUCCESS;
+    crcResult.crc64 = checksum_attr;
+    return crcResult;
+  }
+  if ((x != -1) || !noAttribute(errno))
+  {
+    crcResult.status = ERROR_CRC_CALC;
+    return crcResult;
+  }
+
+  if ((file_handle = openat(file->dirfd, hiddenCRCFile(file), O_RDONLY | O_CLOEXEC)) == -1)
+  {  
+    crcResult.status = (errno == ENOENT) ? ERROR_NO_XATTR : ERROR_CRC_CALC;
+    errno = 0;
+    return crcResult;
+  }
+  if (read(file_handle, &checksum_attr, sizeof(t_crc64)) == -1)
+  {
+    perror("Failure reading hidden checksum file.");
+    close(file_handle);
+    crcResult.status = ERROR_READ_FILE;
+    crcResult.crc64 = 0;
+    return crcResult;
+  }
+  close(file_handle);
+  crcResult.status = SUCCESS;
+  crcResult.crc64 = checksum_attr;
+  return crcResult;
+}
+
+int getFingerprint(fileHandle *file, fileFingerprint *fingerprint)
+{ /* The fingerprint stored with the checksum, from its extended attribute
+   * or after the CRC in the hidden file.  Checksums stored by older
+   * versions don't have one. */
+  int file_handle;
+  ssize_t x = -1;
+
+  if (fsHasXattr(file->fs))
+    x = fgetxattr(file->fd, fingerprintName, (char *)fingerprint, sizeof(fileFingerprint));
+  if (x == sizeof(fileFingerprint))
+    return SUCCESS;
+
+  if ((file_handle = openat(file->dirfd, hiddenCRCFile(file), O_RDONLY | O_CLOEXEC)) == -1)
+  {
+    errno = 0;
+    return ERROR_NO_XATTR;
+  }
+  x = pread(file_handle, fingerprint, sizeof(fileFingerprint), sizeof(t_crc64));
+  close(file_handle);
+  return (x == sizeof(fileFingerprint)) ? SUCCESS : ERROR_NO_XATTR;
+}
+
+int getfsType(fileHandle *file)
+{ /* Filesystem type, from the per-device cache. */
+  return file->fs->fstype;
+}
@@ -1,141 +1,197 @@
-/*  CHECKIT  
-    A file checksummer and integrity tester 
-    Copyright (C) 2014 Dennis Katsonis
-
-    This program is free software: you can redistribute it and/or modify
-    it under the terms of the GNU General Public License as published by
-    the Free Software Foundation, either version 3 of the License, or
-    (at your option) any later version.
-
-    This program is distributed in the hope that it will be useful,
-    but WITHOUT ANY WARRANTY; without even the implied warranty of
-    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
-    GNU General Public License for more details.
-
-    You should have received a copy of the GNU General Public License
-    along with this program.  If not, see <http://www.gnu.org/licenses/>.
-*/
-
-#include <stdint.h>
-#include "config.h"
-#include "crc64.h"
-
-#define RESET_TEXT()	printf("\033[0;0m")
-#define Version VERSION
-
-typedef unsigned long long t_crc64;
-
-enum validities
-{
-  VALID = 0,
-  INVALID = 1
-};
-
-enum errorTypes
-{
-    SUCCESS,
-    ERROR_CRC_CALC,
-    ERROR_REMOVE_XATTR,
-    ERROR_STORE_CRC,
-    ERROR_OPEN_DIR,
-    ERROR_OPEN_FILE,
-    ERROR_READ_FILE,
-    ERROR_SET_CRC,
-    ERROR_REMOVE_HIDDEN,
-    ERROR_NO_XATTR,
-    ERROR_NO_OVERWRITE,
-    ERROR_WRITE_FILE,
-    ERROR_FILENAME_OVERFLOW,
-    ERROR_NO_MEM
-};
-
-enum characterAttributes
-{
-  RESET		= 0,
-  BRIGHT	= 1,
-  DIM		= 2,
-  UNDERLINE	= 3,
-  BLINK		= 4,
-  REVERSE	= 7,
-  HIDDEN	= 8
-};
-
-enum characterColours
-{
-  BLACK		= 0,
-  RED		= 1,
-  GREEN		= 2,
-  YELLOW	= 3,
-  BLUE		= 4,
-  MAGENTA	= 5,
-  CYAN		= 6
-};
-
-enum flags
-{
-  VERBOSE	= 0x01,
-  STORE	   	= 0x02,
-  CHECK		= 0x04,
-  DISPLAY	= 0x08,
-  REMOVE	= 0x10,
-  RECURSE	= 0x20,
-  OVERWRITE	= 0x40,
-  PRINT		= 0x80,
-  EXPORT	= 0x100,
-  IMPORT	= 0x200,
-  PIPEDFILES	= 0x400,
-  SETCRCRO	= 0x800, /* Set CRC to be read only */
-  SETCRCRW	= 0x1000 /* set CRC to be read write */
-};
-
-enum extendedAttributeTypes
-{
-  NO_ATTR = 0,
-  XATTR = 1,
-  HIDDEN_ATTR = 2
-};
-
-enum checkitOptionsEnum
-{
-  UPDATEABLE	= 0x01,
-  STATIC	= 0x02,
-  OPT_ERROR	= 0x04,
-  NO_XATTR_SUPPORT = 0x08
-};
-
-typedef struct {
-  int status;
-  t_crc64 crc64;
-} fileCRC;
-
-
-enum fsTypes {
-VFAT = 1,
-NTFS = 2,
-UDF = 3,
-XFS = 4,
-JFS = 5,
-NFS = 6,
-SMB = 7,
-CIFS = 8,
-BTRFS = 9
-};
-
-static const int LIST_XATTR_BUFFER_SIZE =  2048; /* Statically allocated buffer. */
-
-
-char* hiddenCRCFile(const char *file);
-fileCRC FileCRC64(const char *filename);
-uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l);
-void textcolor(int attr, int fg, int bg);
-fileCRC getCRC(const char *filename);
-int presentCRC64(const char *file);
-int exportCRC(const char *filename, int flags);
-int removeCRC(const char *filename);
-int importCRC(const char *filename, int flags);
-int putCRC(const char *file, int flags);
-
-int vfat_attr(char *file);
-int ntfs_attr(char *file);
-const char* errorMessage(int error);
-int getfsType(const char *file);
+/*  CHECKIT  
+    A file checksummer and integrity tester 
+    Copyright (C) 2014 Dennis Katsonis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include "config.h"
+#include "crc64.h"
+
+#define RESET_TEXT(out)	do { if (colour) fprintf(out, "\033[0;0m"); } while (0)
+#define Version VERSION
+
+typedef unsigned long long t_crc64;
+
+enum validities
+{
+  VALID = 0,
+  INVALID = 1
+};
+
+enum errorTypes
+{
+    SUCCESS,
+    ERROR_CRC_CALC,
+    ERROR_REMOVE_XATTR,
+    ERROR_STORE_CRC,
+    ERROR_OPEN_DIR,
+    ERROR_OPEN_FILE,
+    ERROR_READ_FILE,
+    ERROR_SET_CRC,
+    ERROR_REMOVE_HIDDEN,
+    ERROR_NO_XATTR,
+    ERROR_NO_OVERWRITE,
+    ERROR_WRITE_FILE,
+    ERROR_FILENAME_OVERFLOW,
+    ERROR_NO_MEM
+};
+
+enum characterAttributes
+{
+  RESET		= 0,
+  BRIGHT	= 1,
+  DIM		= 2,
+  UNDERLINE	= 3,
+  BLINK		= 4,
+  REVERSE	= 7,
+  HIDDEN	= 8
+};
+
+enum characterColours
+{
+  BLACK		= 0,
+  RED		= 1,
+  GREEN		= 2,
+  YELLOW	= 3,
+  BLUE		= 4,
+  MAGENTA	= 5,
+  CYAN		= 6
+};
+
+enum flags
+{
+  VERBOSE	= 0x01,
+  STORE	   	= 0x02,
+  CHECK		= 0x04,
+  DISPLAY	= 0x08,
+  REMOVE	= 0x10,
+  RECURSE	= 0x20,
+  OVERWRITE	= 0x40,
+  PRINT		= 0x80,
+  EXPORT	= 0x100,
+  IMPORT	= 0x200,
+  PIPEDFILES	= 0x400,
+  SETCRCRO	= 0x800, /* Set CRC to be read only */
+  SETCRCRW	= 0x1000, /* set CRC to be read write */
+  EXTENTORDER	= 0x2000, /* Hash files in the order their data is on disk */
+  QUICK		= 0x4000, /* Trust the fingerprint instead of reading unchanged files */
+  BLOCKMAP	= 0x8000, /* Store a CRC for each block as well */
+  STOPEARLY	= 0x10000, /* Stop checking a file at its first bad block */
+  APPEND	= 0x20000, /* Only hash what has been added to a file that grew */
+  SURVEY	= 0x40000, /* Only note when files were last verified, for the scheduler */
+  REFLINKS	= 0x80000, /* Hash data shared by reflinked files only once */
+  MARKVERIFIED	= 0x100000 /* Note in the fingerprint when a check passed */
+};
+
+enum extendedAttributeTypes
+{
+  NO_ATTR = 0,
+  XATTR = 1,
+  HIDDEN_ATTR = 2
+};
+
+enum checkitOptionsEnum
+{
+  UPDATEABLE	= 0x01,
+  STATIC	= 0x02,
+  OPT_ERROR	= 0x04,
+  NO_XATTR_SUPPORT = 0x08
+};
+
+typedef struct {
+  int status;
+  t_crc64 crc64;
+  uint64_t length;	/* Bytes the CRC covers, when it was calculated */
+} fileCRC;
+
+typedef struct {
+  uint64_t size;
+  int64_t mtime;	/* Nanoseconds */
+  int64_t ctime;	/* Nanoseconds, before the checksum was stored */
+  int64_t stored;	/* Nanoseconds, clock when the checksum was stored */
+  uint64_t inode;
+  uint64_t length;	/* Bytes the CRC covers */
+  uint64_t tail;	/* CRC of the last APPEND_SAMPLE of those bytes */
+  int64_t verified;	/* Nanoseconds, when the data last matched the CRC */
+} fileFingerprint;	/* What the file looked like when its checksum was stored */
+
+#define FINGERPRINT_SLACK 2000000000LL /* How far ctime may be from when we stored (ns) */
+#define APPEND_SAMPLE (64 * 1024) /* End of the old data read again before appending */
+
+struct fsInfo;
+
+typedef struct {
+  const char *path;	/* Name to print */
+  int dirfd;		/* Directory the file is in */
+  const char *name;	/* Relative to dirfd */
+  int fd;		/* The file, opened once for everything we do */
+  struct stat statbuf;	/* fstat() of fd */
+  struct fsInfo *fs;	/* Filesystem the file is on */
+  char hidden[PATH_MAX]; /* Hidden CRC file, relative to dirfd */
+} fileHandle;
+
+typedef struct {
+  int fd;
+  off_t start;
+  off_t length;		/* Bytes to hash, and then bytes hashed */
+  uint64_t crc;
+  int status;
+} crcRange;		/* Part of a file, hashed by rangeCRC64() */
+
+enum fsTypes {
+VFAT = 1,
+NTFS = 2,
+UDF = 3,
+XFS = 4,
+JFS = 5,
+NFS = 6,
+SMB = 7,
+CIFS = 8,
+BTRFS = 9
+};
+
+static const int LIST_XATTR_BUFFER_SIZE =  2048; /* Statically allocated buffer. */
+
+#define MAX_HASH_THREADS 64
+#define MAX_IO_SIZE (4 * 1024 * 1024) /* Largest preferred I/O size we will honour */
+#define PARALLEL_HASH_MIN_SIZE (64LL * 1024 * 1024) /* Smaller files are hashed by one thread. */
+
+
+int openFileHandle(fileHandle *file, int dirfd, const char *name, const char *path);
+void closeFileHandle(fileHandle *file);
+const char* hiddenCRCFile(fileHandle *file);
+fileCRC FileCRC64(fileHandle *file);
+void *rangeCRC64(void *range);
+uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l);
+void textcolor(FILE *out, int attr, int fg, int bg);
+extern int colour; /* Whether textcolor() does anything */
+fileCRC getCRC(fileHandle *file);
+int presentCRC64(fileHandle *file);
+int exportCRC(fileHandle *file, int flags);
+int removeCRC(fileHandle *file);
+int importCRC(fileHandle *file, int flags);
+int putCRC(fileHandle *file, int flags, FILE *out);
+int getFingerprint(fileHandle *file, fileFingerprint *fingerprint);
+int markVerified(fileHandle *file, const fileCRC *checksum);
+int fingerprintMatches(fileHandle *file, const fileFingerprint *fingerprint);
+
+int vfat_attr(int fd);
+int ntfs_attr(int fd);
+const char* errorMessage(int error);
+int getfsType(fileHandle *file);
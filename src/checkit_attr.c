@@ -19,28 +19,24 @@
 /* Set user customized option for files */
 
 #include <stdlib.h>
-#include <string.h>
 #include <stdio.h>
 #include <errno.h>
 #include <attr/xattr.h>
 #include <stdint.h>
 
 #include "checkit.h"
-#include "fsmagic.h"
+#include "checkit_fs.h"
 #include "checkit_attr.h"
 
 extern int failed;
 extern int processed;
 const char* checkitOptionsName = "user.checkit";
 
-int setCheckitOptions(const char *file, char checkitOptions)
+int setCheckitOptions(fileHandle *file, char checkitOptions)
 {
-  int fstype;
-  fstype = getfsType(file);
-  
-  if(fstype != VFAT && fstype != UDF && fstype != NFS)
+  if (fsHasXattr(file->fs))
   { /* If not VFAT or UDF, attempt to store attribute/option in extended attribute */
-    if ((setxattr(file, checkitOptionsName, (const char *)&checkitOptions, sizeof(checkitOptions), 0)) == -1)
+    if ((fsetxattr(file->fd, checkitOptionsName, (const char *)&checkitOptions, sizeof(checkitOptions), 0)) == -1)
       return ERROR_SET_CRC;
     else
       return 0; /* And we're done here, return to process next file */
@@ -52,37 +48,17 @@ int setCheckitOptions(const char *file, char checkitOptions)
   return SUCCESS;
 }
 
-char getCheckitOptions(const char *file)
+char getCheckitOptions(fileHandle *file)
 { 
-  char buf[LIST_XATTR_BUFFER_SIZE];
-  char *current_attr;
-  int x;
-  char checkitOptions;
-  int fstype;
-  fstype = getfsType(file);
-  
+  char checkitOptions = 0;
   
-  if(fstype != VFAT && fstype != UDF && fstype != NFS)
-  { /* If not VFAT or UDF, attempt to read attribute/option in extended attribute */
-    
-    x = listxattr(file,buf,LIST_XATTR_BUFFER_SIZE);
-    
-    current_attr = buf;    
-    if (x != -1)
+  if (fsHasXattr(file->fs))
+  { /* If not VFAT or UDF, attempt to read attribute/option in extended attribute.
+     * ENODATA just means no option has been set. */
+    if ((fgetxattr(file->fd, checkitOptionsName, (char *)&checkitOptions, sizeof(checkitOptions)) == -1) &&
+	(errno != ENODATA) && (errno != ENOTSUP))
     {
-      do
-      {
-	if (strcmp(current_attr, checkitOptionsName) == 0)
-	{
-	  if ((getxattr(file, checkitOptionsName, (char *)&checkitOptions, sizeof(checkitOptions)) == -1))
-	  {
-	    checkitOptions = OPT_ERROR;
-	  }
-	  break;
-	}
-	else
-	  current_attr += (strlen(current_attr) + 1);
-      } while ((current_attr - buf) < x);
+      checkitOptions = OPT_ERROR;
     }
   }
   else
@@ -92,40 +68,15 @@ char getCheckitOptions(const char *file)
   return checkitOptions; 
 }
 
-int removeCheckitOptions(const char *file)
+int removeCheckitOptions(fileHandle *file)
 {
-  char buf[LIST_XATTR_BUFFER_SIZE];
-  int x;
   int fstype;
-  char *current_attr;
   fstype = getfsType(file);
   
-  if(fstype != VFAT && fstype != UDF && fstype != NFS && fstype != SMB && fstype != CIFS)
-  { /* If not VFAT or UDF or SMB or CIFS, attempt to read attribute/option in extended attribute */
-    
-    x = listxattr(file,buf,LIST_XATTR_BUFFER_SIZE);
-    current_attr = buf;    
-
-    if (x == -1)
-    {
+  if (fsHasXattr(file->fs) && fstype != SMB && fstype != CIFS)
+  { /* If not VFAT or UDF or SMB or CIFS, attempt to remove attribute/option in extended attribute */
+    if ((fremovexattr(file->fd, checkitOptionsName) == -1) && (errno != ENODATA) && (errno != ENOTSUP))
       return ERROR_REMOVE_XATTR;
-    }
-    
-    do
-    {
-      if (strcmp(current_attr, checkitOptionsName) == 0)
-      {
-	if ((removexattr(file, checkitOptionsName)) == -1)
-	{
-	  return ERROR_REMOVE_XATTR;
-	}
-	break;
-      }
-      else
-	current_attr += (strlen(current_attr) + 1);
-    } while ((current_attr - buf) < x);
-    
   }
   return SUCCESS;
 }
-
@@ -16,6 +16,6 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
-char getCheckitOptions(const char *file);
-int setCheckitOptions(const char *file, char checkitOptions);
-int removeCheckitOptions(const char *file);
\ No newline at end of file
+char getCheckitOptions(fileHandle *file);
+int setCheckitOptions(fileHandle *file, char checkitOptions);
+int removeCheckitOptions(fileHandle *file);
\ No newline at end of file
@@ -0,0 +1,368 @@
+/*  CHECKIT  
+    A file checksummer and integrity tester 
+    Copyright (C) 2014 Dennis Katsonis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Per-block CRCs for large files.
+ *
+ * The file is split into BLOCK_MAP_SIZE blocks and each is hashed on its
+ * own, so a bad file can be narrowed down to the blocks that changed, and
+ * the blocks can be read by several threads at once.  The whole file CRC
+ * is the blocks' CRCs put together with crc64_combine(), so it is the
+ * same as FileCRC64() gives.
+ *
+ * The map is kept in an extended attribute if it fits, otherwise in a
+ * hidden .NAME.crc64map file next to the file. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <attr/xattr.h>
+#include <linux/limits.h>
+
+#include "checkit.h"
+#include "checkit_fs.h"
+#include "checkit_io.h"
+#include "checkit_blockmap.h"
+
+extern int hashThreads;
+const char* blockMapName = "user.crc64.map";
+
+typedef struct {
+  fileHandle *file;
+  blockMap *map;
+  const blockMap *expected;	/* Stored map to compare against, or NULL */
+  int stopEarly;
+  uint64_t next;		/* Next block to hash */
+  int stop;			/* Set when the other threads should give up */
+  int status;
+} blockJob;
+
+int wantBlockMap(fileHandle *file)
+{ /* A file of one block gets nothing from a map. */
+  return S_ISREG(file->statbuf.st_mode) && (file->statbuf.st_size > BLOCK_MAP_SIZE);
+}
+
+static const char *mapFile(fileHandle *file, char *name, size_t size)
+{ /* The hidden file for the map, relative to the file's directory. */
+  snprintf(name, size, "%smap", hiddenCRCFile(file));
+  return name;
+}
+
+int hasBlockMap(fileHandle *file)
+{
+  char name[PATH_MAX];
+
+  if (fsHasXattr(file->fs) && (fgetxattr(file->fd, blockMapName, NULL, 0) > 0))
+    return 1;
+  return (faccessat(file->dirfd, mapFile(file, name, sizeof(name)), F_OK, 0) == 0);
+}
+
+static int allocMap(blockMap *map, uint64_t size, uint32_t blockSize, int track)
+{ /* An empty map for a file of size bytes.  With track, also note which
+   * blocks have been hashed. */
+  map->header.magic = BLOCK_MAP_MAGIC;
+  map->header.blockSize = blockSize;
+  map->header.size = size;
+  map->count = (size + blockSize - 1) / blockSize;
+  map->crc = calloc(map->count + 1, sizeof(uint64_t));
+  map->hashed = track ? calloc(map->count + 1, 1) : NULL;
+  if ((map->crc == NULL) || (track && (map->hashed == NULL)))
+  {
+    freeBlockMap(map);
+    return ERROR_NO_MEM;
+  }
+  return SUCCESS;
+}
+
+void freeBlockMap(blockMap *map)
+{
+  free(map->crc);
+  free(map->hashed);
+  map->crc = NULL;
+  map->hashed = NULL;
+}
+
+static void *blockWorker(void *arg)
+{ /* Hash blocks until there are none left, or we are told to stop. */
+  blockJob *job = arg;
+  blockMap *map = job->map;
+  crcRange range;
+  off_t want;
+  uint64_t i;
+
+  range.fd = job->file->fd;
+  while (!__atomic_load_n(&job->stop, __ATOMIC_RELAXED) &&
+	 ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < map->count))
+  {
+    range.start = (off_t)i * map->header.blockSize;
+    want = map->header.size - range.start;
+    if (want > map->header.blockSize)
+      want = map->header.blockSize;
+    range.length = want;
+    rangeCRC64(&range);
+    if ((range.status != SUCCESS) || (range.length != want))
+    { /* Read error, or the file shrunk while we read it */
+      __atomic_store_n(&job->status, ERROR_CRC_CALC, __ATOMIC_RELAXED);
+      __atomic_store_n(&job->stop, 1, __ATOMIC_RELAXED);
+      break;
+    }
+    map->crc[i] = range.crc;
+    map->hashed[i] = 1;
+    if (job->stopEarly && (job->expected != NULL) && (job->expected->crc[i] != range.crc))
+      __atomic_store_n(&job->stop, 1, __ATOMIC_RELAXED);
+  }
+  return NULL;
+}
+
+static int runBlocks(fileHandle *file, blockMap *map, const blockMap *expected, int stopEarly,
+		     uint64_t first, t_crc64 *crc)
+{ /* Hash the blocks of map from first on, using up to hashThreads
+   * threads, and put all the blocks together for the whole file CRC. */
+  pthread_t thread[MAX_HASH_THREADS];
+  int started[MAX_HASH_THREADS];
+  blockJob job;
+  int threads = hashThreads;
+  uint64_t i;
+
+  job.file = file;
+  job.map = map;
+  job.expected = expected;
+  job.stopEarly = stopEarly;
+  job.next = first;
+  job.stop = 0;
+  job.status = SUCCESS;
+
+  if (threads > MAX_HASH_THREADS)
+    threads = MAX_HASH_THREADS;
+  if ((uint64_t)threads > map->count - first)
+    threads = (map->count > first) ? map->count - first : 1;
+  if (scrubIO)
+    posix_fadvise(file->fd, 0, 0, POSIX_FADV_NOREUSE);
+
+  for (i = 1; i < (uint64_t)threads; i++)
+    started[i] = (pthread_create(&thread[i], NULL, blockWorker, &job) == 0);
+  blockWorker(&job); /* This thread works too. */
+  for (i = 1; i < (uint64_t)threads; i++)
+  {
+    if (started[i])
+      pthread_join(thread[i], NULL);
+  }
+  if (scrubIO)
+    posix_fadvise(file->fd, 0, 0, POSIX_FADV_DONTNEED);
+  if (job.status != SUCCESS)
+    return job.status;
+
+  *crc = 0;
+  for (i = 0; i < map->count; i++)
+  {
+    if (!map->hashed[i])
+      break;
+    *crc = crc64_combine(*crc, map->crc[i],
+			 (i + 1 < map->count) ? map->header.blockSize : map->header.size - i * map->header.blockSize);
+  }
+  return SUCCESS;
+}
+
+int hashBlocks(fileHandle *file, blockMap *map, const blockMap *expected, int stopEarly, t_crc64 *crc)
+{ /* Hash each block of the file into map.  With an expected (stored) map,
+   * its block size is used, and with stopEarly, hashing stops at the
+   * first block that doesn't match it.  crc is the whole file's CRC if
+   * every block was hashed, otherwise map->hashed says which were.  The
+   * caller frees map. */
+  int status;
+
+  status = allocMap(map, file->statbuf.st_size, (expected != NULL) ? expected->header.blockSize : BLOCK_MAP_SIZE, 1);
+  if (status != SUCCESS)
+    return status;
+  return runBlocks(file, map, expected, stopEarly, 0, crc);
+}
+
+int extendBlocks(fileHandle *file, blockMap *map, const blockMap *old, t_crc64 *crc)
+{ /* Map a file that has grown since old was made, by keeping old's whole
+   * blocks and only hashing from its last, partial, block on. */
+  uint64_t first = old->header.size / old->header.blockSize;
+  int status;
+
+  status = allocMap(map, file->statbuf.st_size, old->header.blockSize, 1);
+  if (status != SUCCESS)
+    return status;
+  if (first > map->count)
+    first = map->count;
+  memcpy(map->crc, old->crc, first * sizeof(uint64_t));
+  memset(map->hashed, 1, first);
+  return runBlocks(file, map, NULL, 0, first, crc);
+}
+
+int badBlocks(FILE *out, const char *path, const blockMap *map, const blockMap *expected)
+{ /* Count the hashed blocks that don't match the stored map.  If out is
+   * not NULL, print the byte ranges they cover, joining neighbours. */
+  uint64_t i;
+  uint64_t first = 0;
+  uint64_t end;
+  int bad = 0;
+  int inRun = 0;
+
+  for (i = 0; i <= map->count; i++)
+  {
+    if ((i < map->count) && map->hashed[i] && (map->crc[i] != expected->crc[i]))
+    {
+      if (!inRun)
+	first = i;
+      inRun = 1;
+      ++bad;
+      continue;
+    }
+    if (inRun && (out != NULL))
+    {
+      end = i * map->header.blockSize;
+      if (end > map->header.size)
+	end = map->header.size;
+      fprintf(out, "Bad data in %s, bytes %llu to %llu.\n", path,
+	      (unsigned long long)(first * map->header.blockSize), (unsigned long long)(end - 1));
+    }
+    inRun = 0;
+  }
+  return bad;
+}
+
+static int parseMap(blockMap *map, const char *buf, ssize_t bytes)
+{
+  blockMapHeader header;
+
+  if ((buf == NULL) || (bytes < (ssize_t)sizeof(blockMapHeader)))
+    return ERROR_READ_FILE;
+  memcpy(&header, buf, sizeof(header));
+  if ((header.magic != BLOCK_MAP_MAGIC) || (header.blockSize == 0))
+    return ERROR_READ_FILE;
+  if (allocMap(map, header.size, header.blockSize, 0) != SUCCESS)
+    return ERROR_NO_MEM;
+  if ((size_t)bytes != sizeof(blockMapHeader) + map->count * sizeof(uint64_t))
+  {
+    freeBlockMap(map);
+    return ERROR_READ_FILE;
+  }
+  memcpy(map->crc, buf + sizeof(blockMapHeader), map->count * sizeof(uint64_t));
+  return SUCCESS;
+}
+
+int getBlockMap(fileHandle *file, blockMap *map)
+{ /* Read the stored map.  Returns ERROR_NO_XATTR if there isn't one. */
+  char name[PATH_MAX];
+  char *buf = NULL;
+  ssize_t bytes = -1;
+  struct stat statbuf;
+  int file_handle;
+  int result;
+
+  map->crc = NULL;
+  map->hashed = NULL;
+  if (fsHasXattr(file->fs) && ((bytes = fgetxattr(file->fd, blockMapName, NULL, 0)) > 0))
+  {
+    if ((buf = malloc(bytes)) == NULL)
+      return ERROR_NO_MEM;
+    bytes = fgetxattr(file->fd, blockMapName, buf, bytes);
+  }
+  else if ((file_handle = openat(file->dirfd, mapFile(file, name, sizeof(name)), O_RDONLY | O_CLOEXEC)) != -1)
+  {
+    bytes = -1;
+    if ((fstat(file_handle, &statbuf) == 0) && ((buf = malloc(statbuf.st_size + 1)) != NULL) &&
+	(read(file_handle, buf, statbuf.st_size) == statbuf.st_size))
+      bytes = statbuf.st_size;
+    close(file_handle);
+  }
+  else
+  {
+    errno = 0;
+    return ERROR_NO_XATTR;
+  }
+  result = parseMap(map, buf, bytes);
+  free(buf);
+  return result;
+}
+
+int sameBlockMap(fileHandle *file, const blockMap *map)
+{ /* Is this map already stored? */
+  blockMap stored;
+  int same;
+
+  if (getBlockMap(file, &stored) != SUCCESS)
+    return 0;
+  same = (memcmp(&stored.header, &map->header, sizeof(blockMapHeader)) == 0) &&
+    (memcmp(stored.crc, map->crc, map->count * sizeof(uint64_t)) == 0);
+  freeBlockMap(&stored);
+  return same;
+}
+
+int putBlockMap(fileHandle *file, const blockMap *map)
+{ /* Store the map, in an extended attribute if the filesystem will take
+   * one that big, otherwise in the hidden file. */
+  size_t bytes = sizeof(blockMapHeader) + map->count * sizeof(uint64_t);
+  char name[PATH_MAX];
+  char *buf;
+  int file_handle;
+  int result = SUCCESS;
+
+  if ((buf = malloc(bytes)) == NULL)
+    return ERROR_NO_MEM;
+  memcpy(buf, &map->header, sizeof(blockMapHeader));
+  memcpy(buf + sizeof(blockMapHeader), map->crc, map->count * sizeof(uint64_t));
+
+  mapFile(file, name, sizeof(name));
+  if (fsHasXattr(file->fs) && (bytes <= file->fs->maxXattrSize) &&
+      (fsetxattr(file->fd, blockMapName, buf, bytes, 0) == 0))
+  {
+    free(buf);
+    if ((unlinkat(file->dirfd, name, 0) == -1) && (errno != ENOENT))
+      return ERROR_REMOVE_HIDDEN; /* An older map that didn't fit */
+    return SUCCESS;
+  }
+
+  /* Too big for an attribute here (the limit is often one filesystem
+   * block), or no attributes at all. */
+  if ((file_handle = openat(file->dirfd, name, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR)) == -1)
+    result = ERROR_OPEN_FILE;
+  else
+  {
+    if (write(file_handle, buf, bytes) != (ssize_t)bytes)
+      result = ERROR_WRITE_FILE;
+    if (getfsType(file) == VFAT) /* Set hidden flag for VFAT */
+      vfat_attr(file_handle);
+    else if (getfsType(file) == NTFS) /* or NTFS */
+      ntfs_attr(file_handle);
+    close(file_handle);
+  }
+  free(buf);
+  if ((result == SUCCESS) && fsHasXattr(file->fs))
+    fremovexattr(file->fd, blockMapName); /* An older map that did fit */
+  return result;
+}
+
+int removeBlockMap(fileHandle *file)
+{
+  char name[PATH_MAX];
+
+  if (fsHasXattr(file->fs) && (fremovexattr(file->fd, blockMapName) == -1) &&
+      (errno != ENODATA) && (errno != ENOTSUP))
+    return ERROR_REMOVE_XATTR;
+  if ((unlinkat(file->dirfd, mapFile(file, name, sizeof(name)), 0) == -1) && (errno != ENOENT))
+    return ERROR_REMOVE_HIDDEN;
+  return SUCCESS;
+}
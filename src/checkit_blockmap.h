@@ -0,0 +1,47 @@
+/*  CHECKIT  
+    A file checksummer and integrity tester 
+    Copyright (C) 2014 Dennis Katsonis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define BLOCK_MAP_MAGIC 0x70616d63 /* "cmap" */
+#define BLOCK_MAP_SIZE (1024 * 1024) /* Bytes covered by each block's CRC */
+
+typedef struct {
+  uint32_t magic;
+  uint32_t blockSize;
+  uint64_t size;	/* Size of the file when the map was made */
+} blockMapHeader;
+
+typedef struct {
+  blockMapHeader header;
+  uint64_t count;	/* Number of blocks */
+  uint64_t *crc;	/* CRC of each block on its own */
+  unsigned char *hashed; /* Which blocks have been read, NULL if all of them */
+} blockMap;
+
+int wantBlockMap(fileHandle *file);
+int hasBlockMap(fileHandle *file);
+int hashBlocks(fileHandle *file, blockMap *map, const blockMap *expected, int stopEarly, t_crc64 *crc);
+int extendBlocks(fileHandle *file, blockMap *map, const blockMap *old, t_crc64 *crc);
+int badBlocks(FILE *out, const char *path, const blockMap *map, const blockMap *expected);
+int getBlockMap(fileHandle *file, blockMap *map);
+int sameBlockMap(fileHandle *file, const blockMap *map);
+int putBlockMap(fileHandle *file, const blockMap *map);
+int removeBlockMap(fileHandle *file);
+void freeBlockMap(blockMap *map);
@@ -21,32 +21,52 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <sys/stat.h>
-#include <sys/statfs.h>
 #include <linux/limits.h>
 #include <errno.h>
-#include <dirent.h>
-#include <libgen.h>
+#include <time.h>
 
 #include "checkit.h"
 #include "checkit_attr.h"
 #include "strarray.h"
+#include "checkit_walk.h"
+#include "checkit_io.h"
+#include "checkit_throttle.h"
+#include "checkit_fs.h"
+#include "checkit_blockmap.h"
+#include "checkit_schedule.h"
+#include "checkit_journal.h"
+#include "checkit_dedup.h"
+#include "checkit_watch.h"
+#include "checkit_output.h"
+#include "checkit_progress.h"
 
 extern int failed;
 extern int processed;
 extern int nocrc;
+extern int changed;
+extern int hashThreads;
 
 static int processFile(char *filename, int flags);
-static int processDir(char *path, char *dir, int flags);
-static void printErrorMessage(int result, const char *filename);
+static void printErrorMessage(FILE *out, int result, const char *filename);
+static void reportError(FILE *out, fileReport *report, int result, const char *filename);
 
-fileList noCRCFiles;
-fileList badCRCFiles;
+fileList problemFiles; /* Listed again at the end, if verbose */
+int fileListOrder = LIST_FOUND;
 
-void printErrorMessage(int result, const char *filename)
+void printErrorMessage(FILE *out, int result, const char *filename)
 {
     
-  printf("For file %s: %s\n", filename, errorMessage(result));
+  fprintf(out, "For file %s: %s\n", filename, errorMessage(result));
+}
+
+void reportError(FILE *out, fileReport *report, int result, const char *filename)
+{ /* Print an error about a file, and note the first for its report. */
+  if (report->error == SUCCESS)
+    report->error = result;
+  report->status = "ERROR";
+  printErrorMessage(out, result, filename);
 }
 
 void printHeader(void)
@@ -80,314 +100,445 @@ void printLicence(void)
 
   
 
-int processFile(char *filename, int flags)
+enum jobVerdicts
 {
-  struct stat statbuf;
-  int file;
-  fileCRC result;
-  fileCRC resultCRC;
-  int dirResult;
-  static char directory[PATH_MAX - 1];
+  COUNT_PROCESSED = 0x01,
+  COUNT_NOCRC	= 0x02,
+  COUNT_FAILED	= 0x04,
+  COUNT_CHANGED	= 0x08
+};
 
-  char *base_filename;
-  char *dir_filename;
-  char *_filename;
-  char checkitAttributes;
- 
-  /* Seperate filename into directory and filename parts. */
-  _filename = strdup(filename);
-  if (_filename == NULL)
-  {
-    perror("Could not allocate memory :");
-    exit(1);
-  }
-  base_filename = basename(_filename);
-  dir_filename = dirname(_filename);
-  
-  if ((file = stat (filename, &statbuf)) != 0 )
+/* Why a file is in problemFiles */
+#define LIST_NO_CRC "NO CRC"
+#define LIST_FAILED "FAILED"
+#define LIST_CHANGED "CHANGED"
+
+static const char *splitPath(const char *path, char *directory, size_t size)
+{ /* Copies the directory part of path, with a trailing '/', into directory
+   * and returns the filename part.  A bare filename has no directory. */
+  const char *base_filename = strrchr(path, '/');
+  size_t len;
+
+  if (base_filename == NULL)
   {
-    printErrorMessage(ERROR_OPEN_FILE, filename);
-    free(_filename);
-    return ERROR_OPEN_FILE;
+    directory[0] = 0;
+    return path;
   }
-  
-  if (S_ISDIR(statbuf.st_mode) && (flags & RECURSE))
-  {
-    dirResult = processDir(directory, filename, flags);
-    if (dirResult)
-    {
-      printErrorMessage(dirResult, filename);
-      free(_filename);
-      return dirResult;
-    }
-    else
-    {
-      free(_filename); 
-      return 0;
-    }
+  ++base_filename;
+  len = base_filename - path;
+  if (len >= size)
+    len = size - 1;
+  memcpy(directory, path, len);
+  directory[len] = 0;
+  return base_filename;
+}
+
+static fileCRC checkBlocks(fileHandle *file, int flags, blockMap *map, blockMap *stored, int *bad)
+{ /* Hash the file against its stored block map, if it has one that
+   * covers it, so that bad blocks can be found.  Otherwise just hash it.
+   * The caller frees both maps. */
+  fileCRC result;
+
+  if ((getBlockMap(file, stored) != SUCCESS) || (stored->header.size != (uint64_t)file->statbuf.st_size))
+  { /* No map, or the file's size has changed since */
+    freeBlockMap(stored);
+    return sharedCRC64(file, flags);
   }
-  
-  if (base_filename[0] == '.')
-    return 0; /* Don't process hidden files */
-  
-  if (strcmp(dir_filename, ".") != 0)
-    sprintf(directory, "%s/", dir_filename);
+  result.status = hashBlocks(file, map, stored, flags & STOPEARLY, &result.crc64);
+  result.length = map->header.size;
+  if (result.status == SUCCESS)
+    *bad = badBlocks(NULL, file->path, map, stored);
+  return result;
+}
+
+static int checkOpenFile(fileHandle *file, int flags, FILE *out, int *verdict, fileReport *report)
+{ /* Process one regular file, through the one descriptor we hold for it. */
+  fileCRC result;
+  fileCRC resultCRC;
+  fileFingerprint fingerprint;
+  blockMap map;
+  blockMap stored;
+  int bad = 0;			/* Blocks that don't match the stored map */
+  int quick = 0;		/* Checked by fingerprint, 1 if unchanged, -1 if not */
+  int dirResult = 0;
+  char directory[PATH_MAX];
+  const char *filename = file->path;
+  const char *base_filename;
+  char checkitAttributes;
 
-  checkitAttributes = getCheckitOptions(filename);
+  base_filename = splitPath(filename, directory, sizeof(directory));
+  checkitAttributes = getCheckitOptions(file);
+  report->bytes = file->statbuf.st_size;
 
-  if (S_ISREG (statbuf.st_mode))
-  {
-	
-    if (flags & DISPLAY) /* Display CRC64 */
-      {
-	result = getCRC(filename);
-	if(result.status != SUCCESS)
-	{ /* getCRC returns 0 on error, so if 0, print error messsage and exit. */
-	  printErrorMessage(result.status, filename);
-	  return -1;
-	}
-	printf("Checksum for %s: %llx\n", filename, result.crc64);
-	checkitAttributes = getCheckitOptions(filename);
-	if (checkitAttributes == UPDATEABLE)
-	  printf("R/W Checksum: Checkit can update this checksum.\n");
-	if (checkitAttributes == STATIC)
-	  printf("R/O Checksum: Checkit will not update this checksum.\n");
-      }
-    
-    if (flags & SETCRCRO)
+  if (flags & DISPLAY) /* Display CRC64 */
     {
-
-      if(flags & VERBOSE)
-	printf("Setting CRC for %s to remain static/read only.\n", filename);
-      if (setCheckitOptions(filename, STATIC))
-      {
-	printErrorMessage(dirResult,filename);
-        free(_filename);
+      result = getCRC(file);
+      if(result.status != SUCCESS)
+      { /* getCRC returns 0 on error, so if 0, print error messsage and exit. */
+	reportError(out, report, result.status, filename);
 	return -1;
       }
-    } /* End of set CRC option routine */
+      fprintf(out, "Checksum for %s: %llx\n", filename, result.crc64);
+      report->haveStored = 1;
+      report->stored = result.crc64;
+      checkitAttributes = getCheckitOptions(file);
+      if (checkitAttributes == UPDATEABLE)
+	fprintf(out, "R/W Checksum: Checkit can update this checksum.\n");
+      if (checkitAttributes == STATIC)
+	fprintf(out, "R/O Checksum: Checkit will not update this checksum.\n");
+    }
     
-    if (flags & SETCRCRW)
+  if (flags & SETCRCRO)
+  {
+
+    if(flags & VERBOSE)
+      fprintf(out, "Setting CRC for %s to remain static/read only.\n", filename);
+    if ((dirResult = setCheckitOptions(file, STATIC)))
     {
-      if(flags & VERBOSE)
-	printf("Setting CRC for %s to allow updates/read-write.\n", filename);
+      reportError(out, report, dirResult, filename);
+      return -1;
+    }
+  } /* End of set CRC option routine */
+    
+  if (flags & SETCRCRW)
+  {
+    if(flags & VERBOSE)
+      fprintf(out, "Setting CRC for %s to allow updates/read-write.\n", filename);
 
-      if (setCheckitOptions(filename, UPDATEABLE))
-      {
-	printErrorMessage(dirResult,filename);
-        free(_filename);
-	return -1;
-      }
-    } /* End of set CRC option routine */
+    if ((dirResult = setCheckitOptions(file, UPDATEABLE)))
+    {
+      reportError(out, report, dirResult, filename);
+      return -1;
+    }
+  } /* End of set CRC option routine */
       
 
-    if (flags & EXPORT) /* Export CRC to file */
-    {
-      if (flags & VERBOSE)
-	printf("Exporting attribute for %s to %s\n", filename, hiddenCRCFile(basename(filename)));
-      dirResult = exportCRC(filename, flags);
-      if (dirResult)
-      { 
-	printErrorMessage(dirResult, filename);
-        free(_filename);
-	return dirResult;
-      }
-    } /* End of export routine. */
+  if (flags & EXPORT) /* Export CRC to file */
+  {
+    if (flags & VERBOSE)
+      fprintf(out, "Exporting attribute for %s to .%s.crc64\n", filename, base_filename);
+    dirResult = exportCRC(file, flags);
+    if (dirResult)
+    { 
+      reportError(out, report, dirResult, filename);
+      return dirResult;
+    }
+  } /* End of export routine. */
 
-    if (flags & IMPORT) /* Export CRC to file */
+  if (flags & IMPORT) /* Export CRC to file */
+  {
+    dirResult = importCRC(file, flags);
+    if (dirResult)
     {
-      dirResult = importCRC(filename, flags);
-      if (dirResult)
-      {
-	printErrorMessage(dirResult, filename);
-        free(_filename);
-	return dirResult;
-      }
+      reportError(out, report, dirResult, filename);
+      return dirResult;
+    }
       
-    } /* End of export routine. */
+  } /* End of export routine. */
     
     
-    if (flags & STORE) /* Calculate and store CRC64 */
-    {
-      printf("Storing checksum for file %s\n", filename);
+  if (flags & STORE) /* Calculate and store CRC64 */
+  {
+    fprintf(out, "Storing checksum for file %s\n", filename);
       
-      if (checkitAttributes == STATIC)
-      {      
-        /* If checkit attributes say its not updateable
-         * bail out...  Even if there is no CRC64 stored.*/
-          printErrorMessage(ERROR_NO_OVERWRITE, filename);
-          return ERROR_NO_OVERWRITE;
-      } 
-      else if (checkitAttributes == UPDATEABLE)
-      { /* Always overwrite, if explicitely indicated as R/W in the attributes.*/
-        flags |= OVERWRITE;
-      }
+    if (checkitAttributes == STATIC)
+    {      
+      /* If checkit attributes say its not updateable
+       * bail out...  Even if there is no CRC64 stored.*/
+	reportError(out, report, ERROR_NO_OVERWRITE, filename);
+	return ERROR_NO_OVERWRITE;
+    } 
+    else if (checkitAttributes == UPDATEABLE)
+    { /* Always overwrite, if explicitely indicated as R/W in the attributes.*/
+      flags |= OVERWRITE;
+    }
     
-      dirResult = putCRC(filename, flags);
+    dirResult = putCRC(file, flags, out);
 
-      if (dirResult != SUCCESS)
-      {
-	printErrorMessage(dirResult, filename);
-        free(_filename);
-	return dirResult;
-      }
-    } /* End of store routine. */
-    
-    if (flags & CHECK) /* Check CRC */
+    if (dirResult != SUCCESS)
     {
-      resultCRC = getCRC(filename);
+      reportError(out, report, dirResult, filename);
+      return dirResult;
+    }
+    resultCRC = getCRC(file);
+    report->haveStored = (resultCRC.status == SUCCESS);
+    report->stored = resultCRC.crc64;
+  } /* End of store routine. */
+    
+  if (flags & CHECK) /* Check CRC */
+  {
+    map.crc = stored.crc = NULL;
+    map.hashed = stored.hashed = NULL;
+    resultCRC = getCRC(file);
       
-      if (resultCRC.status != ERROR_NO_XATTR) 
-      { /* An error reading the CRC, if there was one */
-        if(resultCRC.status != SUCCESS)
-        { /* getCRC returns 0 on error, so if 0, print error messsage (couldn't read file) and exit. */
-          printErrorMessage(ERROR_READ_FILE, filename);
-          free(_filename);
-          return -1;
-        }
-        result = FileCRC64(filename);
-        if(result.status != SUCCESS)
-        { /* FileCRC64 returns 0 on error, so if 0, print error message (couldn't calculate CRC) and exit. */
-          printErrorMessage(ERROR_CRC_CALC, filename);
-          free(_filename);
-          return -1;
-        }
-      }   
-      /* If no CRC, that is OK, We will just skip the check against the file.*/
-  
-      if ((result.crc64 == resultCRC.crc64) && (resultCRC.status != ERROR_NO_XATTR))
-      {
-	printf("%s%-20s\t[", directory, base_filename);
-	textcolor(BRIGHT,GREEN,BLACK);
-	printf("  OK  ");
-	RESET_TEXT();
-      }
-      else if (resultCRC.status == ERROR_NO_XATTR)
-      {
-	printf("%s%-20s\t[", directory, base_filename);
-        textcolor(BRIGHT,YELLOW,BLACK);
-        printf("NO CRC");
-        ++nocrc;
-        RESET_TEXT();
-        
-        if (flags & VERBOSE)
-        {
-          if (appendFileList(&noCRCFiles, directory, base_filename) == ERROR_NO_MEM)
-          {
-            puts("Out of memory");
-            exit(ERROR_NO_MEM);
-          }
-        }
+    if (resultCRC.status != ERROR_NO_XATTR) 
+    { /* An error reading the CRC, if there was one */
+      if(resultCRC.status != SUCCESS)
+      { /* getCRC returns 0 on error, so if 0, print error messsage (couldn't read file) and exit. */
+	reportError(out, report, ERROR_READ_FILE, filename);
+	return -1;
       }
+      report->haveStored = 1;
+      report->stored = resultCRC.crc64;
+      /* With a fingerprint to go by, a quick check doesn't read the file. */
+      if ((flags & QUICK) && (getFingerprint(file, &fingerprint) == SUCCESS))
+	quick = fingerprintMatches(file, &fingerprint) ? 1 : -1;
       else
-      {
-	printf("%s%-20s\t[", directory, base_filename);
-	textcolor(RESET,RED,BLACK);
-	printf(" FAILED ");
-	++failed;
-	RESET_TEXT();
-        
-        if (flags & VERBOSE)
-        {
-          if (appendFileList(&badCRCFiles, directory, base_filename) == ERROR_NO_MEM)
-          {
-            puts("Out of memory");
-            exit(ERROR_NO_MEM);
-          }
-        }
+	result = checkBlocks(file, flags, &map, &stored, &bad);
+      if (!quick && (result.status != SUCCESS))
+      { /* FileCRC64 returns 0 on error, so if 0, print error message (couldn't calculate CRC) and exit. */
+	reportError(out, report, ERROR_CRC_CALC, filename);
+	freeBlockMap(&map);
+	freeBlockMap(&stored);
+	return -1;
       }
+      report->haveComputed = !quick;
+      if (quick)
+	progressBytes(file->statbuf.st_size);
+      else
+	report->computed = result.crc64;
+    }   
+    /* If no CRC, that is OK, We will just skip the check against the file.*/
+  
+    if (quick < 0)
+    {
+      fprintf(out, "%s%-20s\t[", directory, base_filename);
+      textcolor(out, BRIGHT,YELLOW,BLACK);
+      fprintf(out, "CHANGED");
+      report->status = "CHANGED";
+      *verdict |= COUNT_CHANGED;
+      RESET_TEXT(out);
+    }
+    else if ((resultCRC.status != ERROR_NO_XATTR) && !bad && (quick || (result.crc64 == resultCRC.crc64)))
+    {
+      fprintf(out, "%s%-20s\t[", directory, base_filename);
+      textcolor(out, BRIGHT,GREEN,BLACK);
+      fprintf(out, "  OK  ");
+      RESET_TEXT(out);
+      /* Writing moves ctime, so only when the scheduler wants to know.
+       * Not being able to note it (read only, say) doesn't matter. */
+      if (!quick && (flags & MARKVERIFIED))
+	markVerified(file, &result);
+    }
+    else if (resultCRC.status == ERROR_NO_XATTR)
+    {
+      fprintf(out, "%s%-20s\t[", directory, base_filename);
+      textcolor(out, BRIGHT,YELLOW,BLACK);
+      fprintf(out, "NO CRC");
+      report->status = "NO CRC";
+      *verdict |= COUNT_NOCRC;
+      RESET_TEXT(out);
+    }
+    else
+    {
+      fprintf(out, "%s%-20s\t[", directory, base_filename);
+      textcolor(out, RESET,RED,BLACK);
+      fprintf(out, " FAILED ");
+      report->status = "FAILED";
+      *verdict |= COUNT_FAILED;
+      RESET_TEXT(out);
+    }
 
-    printf("]\n");
-    } /* End of Check CRC routine */
+  fprintf(out, "]\n");
+  if (bad)
+    badBlocks(out, filename, &map, &stored);
+  freeBlockMap(&map);
+  freeBlockMap(&stored);
+  } /* End of Check CRC routine */
 
-    if (flags & REMOVE)
-    {
-      if (flags & VERBOSE)
-	puts("Removing checksum.");
+  if (flags & REMOVE)
+  {
+    if (flags & VERBOSE)
+      fprintf(out, "Removing checksum.\n");
       
-      dirResult = removeCRC(filename);
-      dirResult |= removeCheckitOptions(filename);
+    dirResult = removeCRC(file);
+    dirResult |= removeCheckitOptions(file);
       
-      if (dirResult)
-      {
-	printErrorMessage(dirResult, filename);
-        free(_filename);
-	return dirResult;
-      }
-    } /* End of Remove CRC routine */
-
+    if (dirResult)
+    {
+      reportError(out, report, dirResult, filename);
+      return dirResult;
+    }
+  } /* End of Remove CRC routine */
 
-  } /* End of file processing regime */
-  free(_filename);
-  ++processed;
+  if (report->status == NULL)
+    report->status = "OK";
+  *verdict |= COUNT_PROCESSED;
   return SUCCESS;
 }
 
+static int checkFile(int dirfd, const char *name, const char *filename, const struct stat *statbuf,
+		     int flags, FILE *out, int *verdict, fileReport *report)
+{ /* Process one file.  Runs on a worker thread, so everything printed
+   * goes to out, and counting is left to the caller through verdict.
+   * A regular file is opened once here, and everything else works on
+   * the descriptor. */
+  fileHandle file;
+  char directory[PATH_MAX];
+  int result;
 
-int processDir(char *path, char *dir, int flags)
-{ /* Process directory and files within it */	
-  DIR *dp;
-  char *dirend;
-  struct dirent *entry;
-  struct stat statbuf;
-  struct statfs sstat;
-  
-  if((dp = opendir(dir)) == NULL)
-    return ERROR_OPEN_DIR;
+  if (splitPath(filename, directory, sizeof(directory))[0] == '.')
+    return SUCCESS; /* Don't process hidden files */
 
-  chdir(dir);
-  strcat(path, dir);
-  strcat(path, "/"); /* Assemble directory name. */
+  if (!S_ISREG (statbuf->st_mode))
+  {
+    *verdict |= COUNT_PROCESSED;
+    return SUCCESS;
+  }
 
-  while((entry = readdir(dp)) != NULL)
+  if ((result = openFileHandle(&file, dirfd, name, filename)) != SUCCESS)
   {
-    stat(entry->d_name, &statbuf);
-    statfs(entry->d_name, &sstat);
+    reportError(out, report, result, filename);
+    return result;
+  }
+  result = checkOpenFile(&file, flags, out, verdict, report);
+  closeFileHandle(&file);
+  return result;
+}
 
-    if (S_ISDIR(statbuf.st_mode))
-    {
-    if(strcmp(".", entry->d_name) == 0 || strcmp("..", entry->d_name) == 0)
-      continue;
-      processDir(path, entry->d_name, flags);
-    }
+static void surveyFile(fileJob *job, fileReport *report)
+{ /* First pass of a scheduled check.  Note when the file was last
+   * verified, 0 if never.  Files without a checksum are noted too, so the
+   * check still reports them. */
+  fileHandle file;
+  fileFingerprint fingerprint;
+  char directory[PATH_MAX];
+  int result;
+
+  if ((splitPath(job->path, directory, sizeof(directory))[0] == '.') || !S_ISREG(job->statbuf.st_mode))
+    return;
+  if ((result = openFileHandle(&file, jobDirFd(job), job->name, job->path)) != SUCCESS)
+  {
+    reportError(job->out, report, result, job->path);
+    return;
+  }
+  if (S_ISREG(file.statbuf.st_mode))
+  {
+    if (getCRC(&file).status != SUCCESS)
+      job->verified = NO_CHECKSUM;
     else
+      job->verified = (getFingerprint(&file, &fingerprint) == SUCCESS) ? fingerprint.verified : 0;
+    job->statbuf = file.statbuf;
+  }
+  closeFileHandle(&file);
+}
+
+static double elapsed(const struct timespec *start)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void runJob(fileJob *job)
+{ /* Called by the worker pool for each file */
+  char directory[PATH_MAX];
+  fileReport report;
+  struct timespec start;
+
+  memset(&report, 0, sizeof(report));
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  job->verdict = 0;
+  if (job->status != SUCCESS)
+    reportError(job->out, &report, job->status, job->path);
+  else if (job->flags & SURVEY)
+    surveyFile(job, &report);
+  else if (scheduling && scheduleExpired())
+  { /* Out of time.  Left for the next run. */
+    scheduleSkipped();
+  }
+  else
+  {
+    checkFile(jobDirFd(job), job->name, job->path, &job->statbuf, job->flags, job->out, &job->verdict, &report);
+    if (job->verdict & COUNT_PROCESSED)
+      progressFile();
+    if (job->inDir && (job->flags & VERBOSE))
+      fprintf(job->out, "Processing file %s.\n", splitPath(job->path, directory, sizeof(directory)));
+  }
+  report.seconds = elapsed(&start);
+  writeReport(job->out, job->path, &report);
+}
+
+static void finishJob(fileJob *job)
+{ /* Called in traversal order once a job's output has been printed.
+   * Only this thread updates the counters and file lists. */
+  const char *reason = NULL;
+  int result;
+
+  if (job->flags & SURVEY)
+  { /* Kept until the files to check have been chosen */
+    if ((job->verified >= 0) || (job->verified == NO_CHECKSUM))
     {
-      processFile(entry->d_name, flags);
-      if (flags & VERBOSE)
+      if (addCandidate(job->path, &job->statbuf, job->verified) != SUCCESS)
       {
-	printf("Processing file %s.\n",entry->d_name);
+	puts("Out of memory");
+	exit(ERROR_NO_MEM);
       }
+      job->path = NULL;
     }
-  } /* End while */
-  chdir("..");
-  /* As we go up a directory, we remove the directory name from
-   * the path by setting the '/' character prior to the directory name
-   * to NULL, to truncate the string. */
-  dirend = strrchr(path,'/'); /* The '/' at the end of the path. */
-  if (dirend != NULL)
-    *dirend = 0;
-  dirend = strrchr(path,'/'); /* The '/' at the start of the path. */
-  if (dirend != NULL) /* Make it null, to terminate the string here. */
+    free(job->path);
+    free(job);
+    return;
+  }
+  if (job->verdict & COUNT_NOCRC)
   {
-    *++dirend = 0;
-  } else {
-    path[0] = 0; /* Wasn't found, truncate string to zero. 
-                        It may not be found if the original path did not begin with
-                        a / */
+    ++nocrc;
+    reason = LIST_NO_CRC;
   }
-  closedir(dp);
-  /* We remove the '/' twice because there is one at the end of the path, but we want to delete
-   * the one prior to the last directory entry in the string.*/
-  return 0;
+  if (job->verdict & COUNT_FAILED)
+  {
+    ++failed;
+    reason = LIST_FAILED;
+  }
+  if (job->verdict & COUNT_CHANGED)
+  {
+    ++changed;
+    reason = LIST_CHANGED;
+  }
+  if (job->verdict & COUNT_PROCESSED)
+    ++processed;
+
+  if ((reason != NULL) && (job->flags & VERBOSE))
+  {
+    if ((result = appendFileList(&problemFiles, job->path, reason)) != SUCCESS)
+    {
+      fprintf(statusStream(), "%s\n", (result == ERROR_NO_MEM) ? "Out of memory" : "Could not write the list of files to a temporary file");
+      exit(result);
+    }
+  }
+  free(job->path);
+  free(job);
+}
+
+int processFile(char *filename, int flags)
+{ /* Queue a file or directory named on the command line. */
+  struct stat statbuf;
+ 
+  if (walkResumed(filename))
+    return SUCCESS;
+  if (stat (filename, &statbuf) != 0 )
+  {
+    walkFile(filename, NULL, flags, ERROR_OPEN_FILE);
+    return ERROR_OPEN_FILE;
+  }
+  
+  if (S_ISDIR(statbuf.st_mode) && (flags & RECURSE))
+    walkDirectory(filename, flags);
+  else
+    walkFile(filename, &statbuf, flags, SUCCESS);
+  return SUCCESS;
 }
 
-void textcolor(int attr, int fg, int bg)
+void textcolor(FILE *out, int attr, int fg, int bg)
 { /*Change textcolour */
   char command[13];
 
+  if (!colour)
+    return;
   /* Command is the control command to the terminal */
   sprintf(command, "%c[%d;%d;%dm", 0x1B, attr, fg + 30, bg + 40);
-  printf("%s", command);
+  fprintf(out, "%s", command);
 } /* end of textcolor() */
 
 
@@ -407,12 +558,101 @@ void printHelp(void)
   puts(" -x  Remove stored CRC64 checksum\t-o   Overwrite existing checksum");
   puts(" -r  Recurse through directories\t-i   Import CRC from hidden file");
   puts(" -e  Export CRC to hidden file  \t-f   Read list of files from stdin");
+  puts(" -j N  Process N files at a time\t-t N Hash large files with N threads");
+  puts(" -I M  Read mode, read, uring or mmap\t-Q N Keep N reads in flight (uring)");
+  puts(" -D  Scrub.  Read around the page cache, or drop files from it once read");
+  puts(" -b N  Read at most N bytes/s (K, M, G)\t-O N Do at most N reads per second");
+  puts(" -A P  Slow down while other tasks are stalled on I/O more than P% of the time");
+  puts(" -N  Only use the disks and CPU when nothing else wants them (idle priority)");
+  puts(" -P  When recursing, hash files in the order their data is on disk");
+  puts(" -H N  With -j, read at most N files at a time from each spinning disk (default 1)");
+  puts(" -q  Quick.  Only read files whose size, times or inode changed since");
+  puts("     their checksum was stored.  With -c, report those as changed,");
+  puts("     which leaves the exit status 0");
+  puts(" -m  With -s, also store a CRC for each 1MiB block, so -c can say where");
+  puts("     a file is bad.  Blocks are hashed with -t threads");
+  puts(" -E  With -c, stop checking a file at its first bad block");
+  puts(" -a  With -s -o, if a file has only grown, just hash what was added");
+  puts(" -S N  With -c, check the least recently verified files first, up to N bytes");
+  puts(" -T N  Likewise, for up to N seconds (or m, h, d)");
+  puts(" -R N  Only check files not verified in N days (default 30).  Alone,");
+  puts("       checks enough each run to cover every file in N daily runs");
+  puts(" -Y  With -c, note in each file's fingerprint when it was found OK, for -S,");
+  puts("     -T and -R (which do so anyway).  Otherwise -c writes nothing");
+  puts(" -F FORMAT  Print a record for each file: text (the default), json (one");
+  puts("       object per line) or nul (path, status, stored and computed CRC,");
+  puts("       bytes, seconds and error, each ended by a NUL)");
+  puts(" -G ORDER  With -v, list problem files at the end in the order found (the");
+  puts("       default), sorted by path, or by dir, grouped under each directory");
+  puts(" -Z  Quiet.  Only report files that failed, changed, have no CRC or had errors");
+  puts(" -W  With -s, run until interrupted, storing the checksum of each file");
+  puts("     written to, once it has not been written for a few seconds");
+  puts(" -L  Hash reflinked copies of the same data (snapshots) only once");
+  puts(" -k N, --progress N  Print files and bytes done, rates and the time left to");
+  puts("       stderr every N seconds.  SIGUSR1 prints it at any time");
+  puts(" -K, --prescan  Count the files to go through first, for the time left");
+  puts(" -J FILE  Checkpoint progress to FILE, removed once the run is complete");
+  puts(" -U, --resume  With -J, carry on from FILE's checkpoint, passing over");
+  puts("       files and directories already finished");
   puts(" -u  Allow CRC on this file to be updated (for files you intend to change)");
   puts(" -d  Disallow updating of CRC on this file (for files you do not intend to change)");
   puts(" -V  Print licence");
 }
 
 
+static double parseRate(const char *arg)
+{ /* A number, optionally followed by K, M, G or T.  Returns -1 if invalid. */
+  char *end;
+  double rate;
+
+  rate = strtod(arg, &end);
+  switch (*end)
+  {
+    case 'T' : case 't' :
+      rate *= 1024;
+      /* Fall through */
+    case 'G' : case 'g' :
+      rate *= 1024;
+      /* Fall through */
+    case 'M' : case 'm' :
+      rate *= 1024;
+      /* Fall through */
+    case 'K' : case 'k' :
+      rate *= 1024;
+      ++end;
+      break;
+  }
+  if ((*end != 0) || (end == arg) || (rate <= 0))
+    return -1;
+  return rate;
+}
+
+static double parseDuration(const char *arg)
+{ /* Seconds, or a number followed by s, m, h or d.  Returns -1 if invalid. */
+  char *end;
+  double seconds;
+
+  seconds = strtod(arg, &end);
+  switch (*end)
+  {
+    case 'd' :
+      seconds *= 24;
+      /* Fall through */
+    case 'h' :
+      seconds *= 60;
+      /* Fall through */
+    case 'm' :
+      seconds *= 60;
+      /* Fall through */
+    case 's' :
+      ++end;
+      break;
+  }
+  if ((*end != 0) || (end == arg) || (seconds <= 0))
+    return -1;
+  return seconds;
+}
+
 int main(int argc, char *argv[])
 {
   int optch;
@@ -421,9 +661,32 @@ int main(int argc, char *argv[])
   ssize_t read;
   char *ptr;
   int flags = 0;
+  int jobs = 1;
+  double byteLimit = 0;
+  double opLimit = 0;
+  double pressureLimit = 0;
+  int idle = 0;
+  double byteBudget = 0;
+  double timeBudget = 0;
+  int interval = 0;
+  char *journal = NULL;
+  int resume = 0;
+  int watch = 0;
+  int progress = 0;
+  int prescan = 0;
+  FILE *summary;
+  static const struct option longOptions[] = {
+    {"journal", required_argument, NULL, 'J'},
+    {"resume", no_argument, NULL, 'U'},
+    {"progress", required_argument, NULL, 'k'},
+    {"prescan", no_argument, NULL, 'K'},
+    {NULL, 0, NULL, 0}
+  };
   
+  crc64_init();
+  initOutput();
 
-  while ((optch = getopt(argc, argv,"hscvVudexirfop")) != -1)
+  while ((optch = getopt_long(argc, argv,"hscvVudexirfopqmEaDNPULWZKYt:j:I:Q:b:O:A:H:S:T:R:J:F:G:k:", longOptions, NULL)) != -1)
     switch (optch)
     {
       case 'h' :
@@ -501,6 +764,153 @@ int main(int argc, char *argv[])
       case 'p' :
 	flags |= DISPLAY;
 	break;
+      case 'j' :
+	jobs = atoi(optarg);
+	if ((jobs < 1) || (jobs > MAX_WORKERS))
+	{
+	  printf("Number of jobs must be between 1 and %d.\n", MAX_WORKERS);
+	  return 1;
+	}
+	break;
+      case 't' :
+	hashThreads = atoi(optarg);
+	if ((hashThreads < 1) || (hashThreads > MAX_HASH_THREADS))
+	{
+	  printf("Number of threads must be between 1 and %d.\n", MAX_HASH_THREADS);
+	  return 1;
+	}
+	break;
+      case 'D' :
+	scrubIO = 1;
+	break;
+      case 'b' :
+	if ((byteLimit = parseRate(optarg)) < 0)
+	{
+	  puts("Read rate must be a number of bytes per second, optionally followed by K, M or G.");
+	  return 1;
+	}
+	break;
+      case 'O' :
+	if ((opLimit = parseRate(optarg)) < 0)
+	{
+	  puts("Reads per second must be a positive number.");
+	  return 1;
+	}
+	break;
+      case 'A' :
+	pressureLimit = atof(optarg);
+	if ((pressureLimit <= 0) || (pressureLimit > 100))
+	{
+	  puts("I/O pressure must be a percentage between 0 and 100.");
+	  return 1;
+	}
+	break;
+      case 'N' :
+	idle = 1;
+	break;
+      case 'P' :
+	flags |= EXTENTORDER;
+	break;
+      case 'q' :
+	flags |= QUICK;
+	break;
+      case 'm' :
+	flags |= BLOCKMAP;
+	break;
+      case 'E' :
+	flags |= STOPEARLY;
+	break;
+      case 'a' :
+	flags |= APPEND;
+	break;
+      case 'S' :
+	if ((byteBudget = parseRate(optarg)) < 0)
+	{
+	  puts("Byte budget must be a number of bytes, optionally followed by K, M, G or T.");
+	  return 1;
+	}
+	break;
+      case 'T' :
+	if ((timeBudget = parseDuration(optarg)) < 0)
+	{
+	  puts("Time budget must be a number of seconds, or followed by m, h or d.");
+	  return 1;
+	}
+	break;
+      case 'Y' :
+	flags |= MARKVERIFIED;
+	break;
+      case 'R' :
+	interval = atoi(optarg);
+	if ((interval < 1) || (interval > MAX_INTERVAL))
+	{
+	  printf("Interval must be between 1 and %d days.\n", MAX_INTERVAL);
+	  return 1;
+	}
+	break;
+      case 'F' :
+	if ((outputFormat = outputFormatByName(optarg)) == -1)
+	{
+	  puts("Output format must be one of text, json or nul.");
+	  return 1;
+	}
+	break;
+      case 'G' :
+	if ((fileListOrder = fileListOrderByName(optarg)) == -1)
+	{
+	  puts("File list order must be one of found, sorted or dir.");
+	  return 1;
+	}
+	break;
+      case 'Z' :
+	quiet = 1;
+	break;
+      case 'W' :
+	watch = 1;
+	break;
+      case 'k' :
+	progress = atoi(optarg);
+	if (progress < 1)
+	{
+	  puts("Progress must be reported at least every second.");
+	  return 1;
+	}
+	break;
+      case 'K' :
+	prescan = 1;
+	break;
+      case 'L' :
+	flags |= REFLINKS;
+	break;
+      case 'J' :
+	journal = optarg;
+	break;
+      case 'U' :
+	resume = 1;
+	break;
+      case 'H' :
+	hddStreams = atoi(optarg);
+	if ((hddStreams < 1) || (hddStreams > MAX_WORKERS))
+	{
+	  printf("Files at once per disk must be between 1 and %d.\n", MAX_WORKERS);
+	  return 1;
+	}
+	break;
+      case 'I' :
+	if ((ioMode = ioModeByName(optarg)) == -1)
+	{
+	  puts("Read mode must be one of read, uring or mmap.");
+	  return 1;
+	}
+	break;
+      case 'Q' :
+	ioDepth = atoi(optarg);
+	if ((ioDepth < 1) || (ioDepth > MAX_IO_DEPTH))
+	{
+	  printf("Queue depth must be between 1 and %d.\n", MAX_IO_DEPTH);
+	  return 1;
+	}
+	break;
       case '?' :
 	printHelp();
 	break;
@@ -512,72 +922,157 @@ int main(int argc, char *argv[])
     return(0);
   }
   
-  if (flags & VERBOSE) /* If verbose, we will print faulty files at the end
-                          Otherwise, don't bother.*/
+  if (outputFormat != FORMAT_TEXT)
+    colour = 0;
+  optch = ioMode;
+  if (initIO() != optch)
+    fprintf(statusStream(), "Read mode %s is not available, using %s.\n", ioModeName(optch), ioModeName(ioMode));
+  if (byteBudget || timeBudget || interval)
   {
-    if (initFileList(&noCRCFiles))
+    if (!(flags & CHECK))
     {
-      puts("Failed to allocate memory to start the program.");
-      exit(ERROR_NO_MEM);
+      fprintf(statusStream(), "A budget or interval (-S, -T, -R) can only be used with -c.\n");
+      return 1;
     }
-  
-      if (initFileList(&badCRCFiles))
+    initSchedule(byteBudget, timeBudget, interval ? interval : SCHEDULE_INTERVAL);
+    flags |= SURVEY | MARKVERIFIED; /* The first pass only looks */
+  }
+  if (watch && (!(flags & STORE) || (journal != NULL) || scheduling))
+  {
+    fprintf(statusStream(), "Watching (-W) only goes with -s, and not with -J, -S, -T or -R.\n");
+    return 1;
+  }
+  if (resume && (journal == NULL))
+  {
+    fprintf(statusStream(), "Resuming (-U) needs the journal to resume from (-J).\n");
+    return 1;
+  }
+  if (journal != NULL)
+  {
+    if (scheduling)
     {
-      puts("Failed to allocate memory to start the program.");
-      exit(ERROR_NO_MEM);
+      fprintf(statusStream(), "A journal (-J) can't be used with a budget or interval (-S, -T, -R).\n");
+      return 1;
+    }
+    if (openJournal(journal, flags, resume))
+    {
+      fprintf(statusStream(), "Could not read the journal %s.\n", journal);
+      return 1;
     }
   }
-  
-   
-  if (flags & PIPEDFILES)
+  if (initThrottle(byteLimit, opLimit, pressureLimit / 100))
+    fprintf(statusStream(), "I/O pressure information (/proc/pressure/io) is not available.  Not adapting to it.\n");
+  if (idle && idleScheduling())
+    fprintf(statusStream(), "Could not set idle I/O and CPU scheduling.\n");
+
+  if (flags & VERBOSE) /* If verbose, we will print faulty files at the end
+                          Otherwise, don't bother.*/
   {
-    while ((read = getline(&line, &size, stdin) != -1))
+    fprintf(statusStream(), "Using %s CRC64 routine.\n", crc64_kernel_name());
+    fprintf(statusStream(), "Reading files with %s.\n", ioModeName(ioMode));
+    if (initFileList(&problemFiles, fileListOrder, FILE_LIST_MEMORY))
     {
-    ptr = strrchr(line, '\n');
-    if (ptr != NULL)
-      *ptr = 0;
-    processFile(line, flags);
+      fprintf(statusStream(), "Failed to allocate memory to start the program.\n");
+      exit(ERROR_NO_MEM);
     }
-  free(line);
   }
 
-  optch = optind;
+  /* Before the worker threads, which take on its blocked signals.  What
+   * is read from stdin, or chosen by a schedule, can't be counted now. */
+  startProgress(argv + optind, ((flags & PIPEDFILES) || scheduling || watch) ? 0 : argc - optind,
+		flags, progress, prescan);
 
-  if (optch < argc)
+  if (initWalk(jobs, runJob, finishJob))
   {
-    do
+    fprintf(statusStream(), "Failed to start worker threads.\n");
+    exit(ERROR_NO_MEM);
+  }
+   
+  if (watch)
+  { /* Nothing is gone through now.  Files are stamped as they are written. */
+    if (optind == argc)
     {
-      processFile(argv[optch], flags);
+      fprintf(statusStream(), "No files specified.\n");
+      return 0;
     }
-    while ( ++optch < argc);
-  }  
-  else if (!(flags & PIPEDFILES))
+    if (watchFiles(argv + optind, argc - optind, flags, processFile) != SUCCESS)
+      fprintf(statusStream(), "Could not watch for files being written.\n");
+  }
+  else
   {
-    puts("No files specified.");
-    return 0;
+    if (flags & PIPEDFILES)
+    {
+      while ((read = getline(&line, &size, stdin) != -1))
+      {
+      ptr = strrchr(line, '\n');
+      if (ptr != NULL)
+	*ptr = 0;
+      processFile(line, flags);
+      }
+    free(line);
+    }
+
+    optch = optind;
+
+    if (optch < argc)
+    {
+      do
+      {
+	processFile(argv[optch], flags);
+      }
+      while ( ++optch < argc);
+    }  
+    else if (!(flags & PIPEDFILES))
+    {
+      fprintf(statusStream(), "No files specified.\n");
+      return 0;
+    }
+  }
+  if (scheduling)
+  { /* Now check the stalest of what was found */
+    drainWalk();
+    runSchedule(flags & ~SURVEY);
   }
-  printf("Total of %d file(s) processed.\n", processed);
+  finishWalk();
+  stopProgress();
+  if (journaling)
+    closeJournal();
+  summary = statusStream();
+  fprintf(summary, "Total of %d file(s) processed.\n", processed);
+  if (scheduling)
+    scheduleSummary(summary);
   if (nocrc && processed)
   {
-    printf("\nWARNING: **** %d file(s) without a checksum ****\n", nocrc);
+    fprintf(summary, "\nWARNING: **** %d file(s) without a checksum ****\n", nocrc);
+    if (flags & VERBOSE)
+    {
+      printFileList(summary, &problemFiles, LIST_NO_CRC);
+      putc('\n', summary);
+    }
+  }
+  if (changed && processed)
+  {
+    fprintf(summary, "\nWARNING: **** %d file(s) changed since their checksum was stored ****\n", changed);
     if (flags & VERBOSE)
     {
-      puts(getFileList(&noCRCFiles));
-      freeFileList(&noCRCFiles);
+      printFileList(summary, &problemFiles, LIST_CHANGED);
+      putc('\n', summary);
     }
   }
   if (failed && processed)
     {
-    printf("\nERROR: **** %d file(s) failed ****\n", failed);
+    fprintf(summary, "\nERROR: **** %d file(s) failed ****\n", failed);
     if (flags & VERBOSE)
     {
-      puts(getFileList(&badCRCFiles));
-      freeFileList(&noCRCFiles);
+      printFileList(summary, &problemFiles, LIST_FAILED);
+      putc('\n', summary);
+      freeFileList(&problemFiles);
     }
     return(failed);
     } /* Return the number of failed checks if any errors. */
-  else if (processed && (flags & CHECK))
-    printf("All file(s) OK.\n");
-  
+  else if (processed && !changed && (flags & CHECK))
+    fprintf(summary, "All file(s) OK.\n");
+  if (flags & VERBOSE)
+    freeFileList(&problemFiles);
   return 0;
 }
@@ -0,0 +1,333 @@
+/*  CHECKIT  
+    A file checksummer and integrity tester 
+    Copyright (C) 2014 Dennis Katsonis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Hashing each piece of data once.
+ *
+ * Hard links are one inode, so a file with more than one link is
+ * remembered by device and inode until all its links have been seen.
+ * With REFLINKS, a file whose data is all in extents shared with other
+ * files (reflinked copies, snapshots) is also remembered by its extent
+ * map, and a file with exactly the same map has the same data, whatever
+ * its times.  There is no telling how many files share an extent, so
+ * only the most recent maps are kept.  Copies are usually close together
+ * in the walk, and one that is missed is just read again.  The CRC
+ * is worked out by whichever worker gets to the data first, and the
+ * others wait for it rather than reading the data again. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+#include "checkit.h"
+#include "checkit_fs.h"
+#include "checkit_dedup.h"
+#include "checkit_progress.h"
+
+#define DEDUP_BUCKETS 4096 /* To start with, doubled as needed */
+#define BAD_EXTENT (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_ENCODED | \
+		    FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_DATA_TAIL | FIEMAP_EXTENT_NOT_ALIGNED)
+
+enum dedupStates
+{
+  DEDUP_HASHING,
+  DEDUP_DONE,
+  DEDUP_FAILED	/* Each file is hashed on its own instead */
+};
+
+typedef struct {
+  uint64_t logical;
+  uint64_t physical;
+  uint64_t length;
+  uint32_t unwritten;	/* Reads as zeroes */
+} dedupExtent;
+
+typedef struct dedupEntry {
+  struct dedupEntry *next;
+  uint64_t hash;
+  uint64_t dev;		/* Device for a hard link, volume for an extent map */
+  uint64_t ino;		/* 0 for an extent map */
+  uint64_t size;
+  int64_t mtime;
+  int extents;
+  dedupExtent *extent;	/* NULL for a hard link */
+  nlink_t links;	/* Links still to be seen, for a hard link */
+  struct dedupEntry *newer; /* Extent maps, oldest first, once hashed */
+  int waiting;		/* Workers waiting for the CRC */
+  int state;
+  fileCRC crc;
+} dedupEntry;
+
+static pthread_mutex_t dedupLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dedupCond = PTHREAD_COND_INITIALIZER;
+static dedupEntry **bucket = NULL;
+static size_t buckets = 0;
+static size_t entries = 0;
+static dedupEntry *oldestMap = NULL;
+static dedupEntry *newestMap = NULL;
+static size_t maps = 0;
+
+static uint64_t mix(uint64_t hash, uint64_t value)
+{
+  hash ^= value + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2);
+  return hash;
+}
+
+static void hashKey(dedupEntry *key)
+{
+  uint64_t hash = mix(mix(mix(key->dev, key->ino), key->size), key->mtime);
+  int i;
+
+  for (i = 0; i < key->extents; i++)
+    hash = mix(mix(mix(hash, key->extent[i].logical), key->extent[i].physical), key->extent[i].length);
+  key->hash = hash;
+}
+
+static int extentMap(fileHandle *file, dedupEntry *key, dedupExtent *extent)
+{ /* Fill in key with the file's extent map, if it's worth remembering:
+   * every extent shared, and all of them plain data on disk. */
+  struct {
+    struct fiemap map;
+    struct fiemap_extent extent[DEDUP_MAX_EXTENTS];
+  } fm;
+  unsigned int i;
+
+  memset(&fm.map, 0, sizeof(fm.map));
+  fm.map.fm_length = FIEMAP_MAX_OFFSET;
+  fm.map.fm_flags = FIEMAP_FLAG_SYNC; /* So nothing is still to be written */
+  fm.map.fm_extent_count = DEDUP_MAX_EXTENTS;
+  if ((ioctl(file->fd, FS_IOC_FIEMAP, &fm.map) != 0) || (fm.map.fm_mapped_extents == 0) ||
+      !(fm.extent[fm.map.fm_mapped_extents - 1].fe_flags & FIEMAP_EXTENT_LAST))
+    return 0;
+  for (i = 0; i < fm.map.fm_mapped_extents; i++)
+  {
+    if (!(fm.extent[i].fe_flags & FIEMAP_EXTENT_SHARED) || (fm.extent[i].fe_flags & BAD_EXTENT))
+      return 0;
+    extent[i].logical = fm.extent[i].fe_logical;
+    extent[i].physical = fm.extent[i].fe_physical;
+    extent[i].length = fm.extent[i].fe_length;
+    extent[i].unwritten = (fm.extent[i].fe_flags & FIEMAP_EXTENT_UNWRITTEN) != 0;
+  }
+  key->dev = file->fs->volume;
+  key->ino = 0;
+  key->mtime = 0; /* The same extents are the same data */
+  key->extents = fm.map.fm_mapped_extents;
+  key->extent = extent;
+  return 1;
+}
+
+static int sameKey(const dedupEntry *a, const dedupEntry *b)
+{
+  return (a->hash == b->hash) && (a->dev == b->dev) && (a->ino == b->ino) &&
+    (a->size == b->size) && (a->mtime == b->mtime) && (a->extents == b->extents) &&
+    ((a->extents == 0) || (memcmp(a->extent, b->extent, a->extents * sizeof(dedupExtent)) == 0));
+}
+
+static dedupEntry *findEntry(const dedupEntry *key)
+{
+  dedupEntry *entry;
+
+  if (buckets == 0)
+    return NULL;
+  for (entry = bucket[key->hash % buckets]; entry != NULL; entry = entry->next)
+    if (sameKey(entry, key))
+      return entry;
+  return NULL;
+}
+
+static void growTable(void)
+{
+  dedupEntry **old = bucket;
+  dedupEntry *entry, *next;
+  size_t oldBuckets = buckets;
+  size_t i;
+
+  buckets = buckets ? buckets * 2 : DEDUP_BUCKETS;
+  bucket = calloc(buckets, sizeof(dedupEntry *));
+  if (bucket == NULL)
+  {
+    perror("Could not allocate memory :");
+    exit(ERROR_NO_MEM);
+  }
+  for (i = 0; i < oldBuckets; i++)
+    for (entry = old[i]; entry != NULL; entry = next)
+    {
+      next = entry->next;
+      entry->next = bucket[entry->hash % buckets];
+      bucket[entry->hash % buckets] = entry;
+    }
+  free(old);
+}
+
+static dedupEntry *addEntry(const dedupEntry *key)
+{ /* Remember key, with its CRC to come. */
+  dedupEntry *entry = malloc(sizeof(dedupEntry));
+
+  if (entry == NULL)
+  {
+    perror("Could not allocate memory :");
+    exit(ERROR_NO_MEM);
+  }
+  *entry = *key;
+  if (key->extents > 0)
+  {
+    entry->extent = malloc(key->extents * sizeof(dedupExtent));
+    if (entry->extent == NULL)
+    {
+      perror("Could not allocate memory :");
+      exit(ERROR_NO_MEM);
+    }
+    memcpy(entry->extent, key->extent, key->extents * sizeof(dedupExtent));
+  }
+  entry->waiting = 0;
+  entry->state = DEDUP_HASHING;
+  if (entries >= buckets)
+    growTable();
+  entry->next = bucket[entry->hash % buckets];
+  bucket[entry->hash % buckets] = entry;
+  ++entries;
+  return entry;
+}
+
+static void removeEntry(dedupEntry *entry)
+{
+  dedupEntry **link;
+
+  for (link = &bucket[entry->hash % buckets]; *link != entry; link = &(*link)->next)
+    ;
+  *link = entry->next;
+  --entries;
+  free(entry->extent);
+  free(entry);
+}
+
+static void dropEntry(dedupEntry *entry)
+{ /* Forget a hard link once all its links have been seen, and nobody is
+   * still waiting for it. */
+  if ((entry->extents > 0) || (entry->links > 0) || (entry->waiting > 0) || (entry->state == DEDUP_HASHING))
+    return;
+  removeEntry(entry);
+}
+
+static void keepMap(dedupEntry *entry)
+{ /* Called once an extent map's CRC is known.  Forgets the oldest maps
+   * if there are too many. */
+  entry->newer = NULL;
+  if (newestMap != NULL)
+    newestMap->newer = entry;
+  else
+    oldestMap = entry;
+  newestMap = entry;
+  ++maps;
+  while ((maps > DEDUP_MAX_MAPS) && (oldestMap->waiting == 0))
+  {
+    entry = oldestMap;
+    oldestMap = entry->newer;
+    if (oldestMap == NULL)
+      newestMap = NULL;
+    --maps;
+    removeEntry(entry);
+  }
+}
+
+static int reuseCRC(dedupEntry *entry, fileCRC *crc)
+{ /* Wait for the CRC of data already being hashed.  Called with
+   * dedupLock held.  Returns 0 if it couldn't be hashed. */
+  int done;
+
+  ++entry->waiting;
+  while (entry->state == DEDUP_HASHING)
+    pthread_cond_wait(&dedupCond, &dedupLock);
+  --entry->waiting;
+  done = (entry->state == DEDUP_DONE);
+  if (done)
+    *crc = entry->crc;
+  dropEntry(entry);
+  return done;
+}
+
+fileCRC sharedCRC64(fileHandle *file, int flags)
+{ /* FileCRC64(), but each hard linked or (with REFLINKS) reflinked file's
+   * data is only read once. */
+  dedupEntry key[2];
+  dedupEntry *entry[2] = { NULL, NULL };
+  dedupExtent extent[DEDUP_MAX_EXTENTS];
+  fileCRC crc;
+  int keys = 0;
+  int i;
+
+  if (!S_ISREG(file->statbuf.st_mode))
+    return FileCRC64(file);
+  memset(key, 0, sizeof(key));
+  for (i = 0; i < 2; i++)
+  {
+    key[i].size = file->statbuf.st_size;
+    key[i].mtime = file->statbuf.st_mtim.tv_sec * 1000000000LL + file->statbuf.st_mtim.tv_nsec;
+  }
+  if (file->statbuf.st_nlink > 1)
+  {
+    key[keys].dev = file->statbuf.st_dev;
+    key[keys].ino = file->statbuf.st_ino;
+    key[keys].links = file->statbuf.st_nlink - 1;
+    hashKey(&key[keys++]);
+  }
+  if ((flags & REFLINKS) && extentMap(file, &key[keys], extent))
+    hashKey(&key[keys++]);
+  if (keys == 0)
+    return FileCRC64(file);
+
+  pthread_mutex_lock(&dedupLock);
+  for (i = 0; i < keys; i++)
+  {
+    if ((entry[i] = findEntry(&key[i])) == NULL)
+      continue;
+    if (entry[i]->links > 0)
+      --entry[i]->links;
+    if (reuseCRC(entry[i], &crc))
+    {
+      pthread_mutex_unlock(&dedupLock);
+      progressBytes(file->statbuf.st_size); /* Read for another file */
+      return crc;
+    }
+    entry[i] = NULL; /* Failed, so don't wait on it again */
+  }
+  for (i = 0; i < keys; i++)
+    if (findEntry(&key[i]) == NULL)
+      entry[i] = addEntry(&key[i]);
+  pthread_mutex_unlock(&dedupLock);
+
+  crc = FileCRC64(file);
+
+  pthread_mutex_lock(&dedupLock);
+  for (i = 0; i < keys; i++)
+  {
+    if (entry[i] == NULL)
+      continue;
+    entry[i]->crc = crc;
+    entry[i]->state = (crc.status == SUCCESS) ? DEDUP_DONE : DEDUP_FAILED;
+    if (entry[i]->extents > 0)
+      keepMap(entry[i]);
+    else
+      dropEntry(entry[i]);
+  }
+  pthread_cond_broadcast(&dedupCond);
+  pthread_mutex_unlock(&dedupLock);
+  return crc;
+}
@@ -0,0 +1,263 @@
+/*  CHECKIT  
+    A file checksummer and integrity tester 
+    Copyright (C) 2014 Dennis Katsonis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Per-device cache of filesystem capabilities.  statfs() and the xattr
+ * probe are done once for each st_dev, rather than for every file.
+ *
+ * Also which worker lane each device's files go in.  Partitions of the
+ * same disk share a lane, and a spinning disk's lane only has hddStreams
+ * files read from it at once. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/sysmacros.h>
+#include <sys/statfs.h>
+#include <sys/ioctl.h>
+#include <attr/xattr.h>
+#include <linux/limits.h>
+#include <linux/btrfs.h>
+
+#include "checkit.h"
+#include "checkit_fs.h"
+#include "checkit_pool.h"
+#include "fsmagic.h"
+
+static fsInfo *fsCache = NULL; /* Only ever added to, so can be read without the lock */
+static pthread_mutex_t fsLock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct devLane {
+  dev_t dev;
+  dev_t disk;		/* Whole disk, or dev itself if not known */
+  int lane;
+  struct devLane *next;
+} devLane;
+
+static devLane *laneCache = NULL;
+static pthread_mutex_t laneLock = PTHREAD_MUTEX_INITIALIZER;
+int hddStreams = 1;	/* Files read at once from each spinning disk */
+
+static int fsType(long magic)
+{
+  switch (magic)
+    {
+    case MSDOS_SUPER_MAGIC:
+      return VFAT;
+    case NTFS_SUPER_MAGIC:
+      return NTFS;
+    case UDF_SUPER_MAGIC:
+      return UDF;
+    case XFS_SUPER_MAGIC:
+      return XFS;
+    case JFS_SUPER_MAGIC:
+      return JFS;
+    case NFS_SUPER_MAGIC:
+      return NFS;
+    case SMB_SUPER_MAGIC:
+      return SMB;
+    case CIFS_MAGIC_NUMBER:
+    case SMB2_MAGIC_NUMBER:
+      return CIFS;
+    case BTRFS_TEST_MAGIC:
+    case BTRFS_SUPER_MAGIC:
+      return BTRFS;
+    default:
+      return 0;
+    }
+}
+
+static uint64_t volumeId(fsInfo *fs, int fd)
+{ /* Something to tell filesystems apart by, where physical addresses
+   * are comparable.  Btrfs gives each subvolume its own st_dev, but
+   * they all share the same disk space. */
+  struct btrfs_ioctl_fs_info_args info;
+  uint64_t id[2];
+
+  if (fs->fstype == BTRFS)
+  {
+    memset(&info, 0, sizeof(info));
+    if (ioctl(fd, BTRFS_IOC_FS_INFO, &info) == 0)
+    {
+      memcpy(id, info.fsid, sizeof(id));
+      return id[0] ^ id[1];
+    }
+  }
+  return fs->dev;
+}
+
+static void probeFs(fsInfo *fs, int fd)
+{ /* fd is any open file on the filesystem. */
+  struct statfs sstat;
+  char probe;
+
+  if (fstatfs(fd, &sstat) == -1)
+  {
+    sstat.f_type = 0;
+    sstat.f_bsize = 0;
+  }
+  fs->magic = sstat.f_type;
+  fs->fstype = fsType(sstat.f_type);
+  fs->ioSize = (sstat.f_bsize > 0) ? sstat.f_bsize : 4096;
+  fs->volume = volumeId(fs, fd);
+
+  /* Network and userspace filesystems can fail page faults (SIGBUS) for
+   * reasons other than truncation, and gain little from mapping. */
+  switch (sstat.f_type)
+    {
+    case NFS_SUPER_MAGIC:
+    case SMB_SUPER_MAGIC:
+    case CIFS_MAGIC_NUMBER:
+    case SMB2_MAGIC_NUMBER:
+    case FUSE_SUPER_MAGIC:
+    case V9FS_MAGIC:
+    case CEPH_SUPER_MAGIC:
+      fs->mmapOk = 0;
+      break;
+    default:
+      fs->mmapOk = 1;
+      break;
+    }
+
+  /* We never use xattrs on these, even if the driver has them. */
+  if ((fs->fstype == VFAT) || (fs->fstype == UDF) || (fs->fstype == NFS))
+    fs->userXattr = 0;
+  else /* Asking for an attribute that isn't there tells us if the user namespace works at all. */
+    fs->userXattr = !((fgetxattr(fd, "user.checkit.probe", &probe, sizeof(probe)) == -1) &&
+		      ((errno == ENOTSUP) || (errno == ENOSYS)));
+
+  /* ext2/3/4 keep all of a file's attributes in one block. */
+  if ((sstat.f_type == EXT4_SUPER_MAGIC) && (sstat.f_bsize > 0) && (sstat.f_bsize < XATTR_SIZE_MAX))
+    fs->maxXattrSize = sstat.f_bsize;
+  else
+    fs->maxXattrSize = XATTR_SIZE_MAX;
+  errno = 0;
+}
+
+fsInfo *lookupFs(int fd, dev_t dev)
+{ /* Find the filesystem dev, probing it through fd the first time. */
+  fsInfo *fs;
+
+  for (fs = __atomic_load_n(&fsCache, __ATOMIC_ACQUIRE); fs != NULL; fs = fs->next)
+    if (fs->dev == dev)
+      return fs;
+
+  pthread_mutex_lock(&fsLock);
+  for (fs = fsCache; fs != NULL; fs = fs->next)
+    if (fs->dev == dev)
+      break;
+  if ((fs == NULL) && ((fs = malloc(sizeof(fsInfo))) != NULL))
+  {
+    fs->dev = dev;
+    probeFs(fs, fd);
+    fs->next = fsCache;
+    __atomic_store_n(&fsCache, fs, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&fsLock);
+
+  if (fs == NULL)
+  {
+    puts("Out of memory");
+    exit(ERROR_NO_MEM);
+  }
+  return fs;
+}
+
+int fsHasXattr(fsInfo *fs)
+{
+  return __atomic_load_n(&fs->userXattr, __ATOMIC_RELAXED);
+}
+
+void fsNoXattr(fsInfo *fs)
+{ /* Storing an attribute failed as unsupported, even though the probe
+   * thought they worked.  Don't try again on this filesystem. */
+  __atomic_store_n(&fs->userXattr, 0, __ATOMIC_RELAXED);
+}
+
+static int readSys(const char *dir, const char *name, char *buf, size_t size)
+{
+  char path[PATH_MAX];
+  FILE *fp;
+  int result = -1;
+
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  if ((fp = fopen(path, "r")) == NULL)
+    return -1;
+  if (fgets(buf, size, fp) != NULL)
+    result = 0;
+  fclose(fp);
+  return result;
+}
+
+static int blockDisk(dev_t dev, dev_t *disk, int *rotational)
+{ /* Find the whole disk behind a block device, and whether it spins.
+   * Fails for devices with no block device (tmpfs, NFS, btrfs). */
+  char path[PATH_MAX];
+  char real[PATH_MAX];
+  char buf[32];
+  unsigned int maj, min;
+
+  snprintf(path, sizeof(path), "/sys/dev/block/%u:%u", major(dev), minor(dev));
+  if (realpath(path, real) == NULL)
+    return -1;
+  if ((readSys(real, "partition", buf, sizeof(buf)) == 0) && (strrchr(real, '/') != NULL))
+    *strrchr(real, '/') = 0; /* The disk is the partition's parent */
+  if ((readSys(real, "dev", buf, sizeof(buf)) != 0) || (sscanf(buf, "%u:%u", &maj, &min) != 2))
+    return -1;
+  *disk = makedev(maj, min);
+  *rotational = (readSys(real, "queue/rotational", buf, sizeof(buf)) == 0) && (atoi(buf) == 1);
+  return 0;
+}
+
+int deviceLane(dev_t dev)
+{ /* The worker lane for files on dev. */
+  devLane *entry;
+  devLane *same;
+  dev_t disk;
+  int rotational;
+  int lane = 0;
+
+  pthread_mutex_lock(&laneLock);
+  for (entry = laneCache; entry != NULL; entry = entry->next)
+    if (entry->dev == dev)
+      break;
+  if (entry != NULL)
+    lane = entry->lane;
+  else if ((entry = malloc(sizeof(devLane))) != NULL)
+  {
+    entry->dev = entry->disk = dev;
+    entry->lane = 0;
+    if (blockDisk(dev, &disk, &rotational) == 0)
+    {
+      entry->disk = disk;
+      for (same = laneCache; same != NULL; same = same->next)
+	if (same->disk == disk)
+	  break;
+      entry->lane = (same != NULL) ? same->lane : addLane(rotational ? hddStreams : 0);
+    }
+    else
+      entry->lane = addLane(0);
+    entry->next = laneCache;
+    laneCache = entry;
+    lane = entry->lane;
+  }
+  pthread_mutex_unlock(&laneLock);
+  return lane;
+}
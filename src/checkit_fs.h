@@ -0,0 +1,41 @@
+/*  CHECKIT  
+    A file checksummer and integrity tester 
+    Copyright (C) 2014 Dennis Katsonis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* What we know about a mounted filesystem.  Worked out the first time
+ * a file on the device is seen, and never freed. */
+typedef struct fsInfo {
+  dev_t dev;
+  long magic;		/* f_type from statfs() */
+  int fstype;		/* From enum fsTypes, 0 if nothing special */
+  int userXattr;	/* User extended attributes can be used */
+  size_t maxXattrSize;	/* Largest single attribute value */
+  size_t ioSize;	/* Preferred I/O size */
+  int mmapOk;		/* Hashing through mmap() is a good idea here */
+  uint64_t volume;	/* The same for every subvolume of one filesystem */
+  struct fsInfo *next;
+} fsInfo;
+
+extern int hddStreams;
+
+fsInfo *lookupFs(int fd, dev_t dev);
+int deviceLane(dev_t dev);
+int fsHasXattr(fsInfo *fs);
+void fsNoXattr(fsInfo *fs);
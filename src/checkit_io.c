@@ -0,0 +1,511 @@
+/*  CHECKIT  
+    A file checksummer and integrity tester 
+    Copyright (C) 2014 Dennis Katsonis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Read engines for hashing files.  The io_uring engine talks to the
+ * kernel directly, so liburing is not needed.  Each thread gets its own
+ * ring, set up the first time it hashes a file. */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#endif
+
+#include "crc64.h"
+#include "checkit_io.h"
+#include "checkit_throttle.h"
+#include "checkit_progress.h"
+
+int ioMode = IO_READ;
+int ioDepth = 8;	/* Reads kept in flight by the io_uring engine */
+int scrubIO = 0;	/* Keep what we read out of the page cache */
+
+static const char *ioModeNames[] = { "read", "uring", "mmap" };
+
+int ioModeByName(const char *name)
+{ /* Returns the mode, or -1 if there is no such mode. */
+  int i;
+
+  for (i = 0; i < (int)(sizeof(ioModeNames) / sizeof(ioModeNames[0])); i++)
+    if (strcmp(name, ioModeNames[i]) == 0)
+      return i;
+  return -1;
+}
+
+const char *ioModeName(int mode)
+{
+  return ioModeNames[mode];
+}
+
+static pthread_key_t directKey;
+static pthread_once_t directOnce = PTHREAD_ONCE_INIT;
+static __thread unsigned char *directBuf; /* Each thread's aligned buffer, kept between files */
+
+static void makeDirectKey(void)
+{
+  pthread_key_create(&directKey, free);
+}
+
+int setDirect(int fd, int on)
+{ /* Turn O_DIRECT on or off for an open file.  Fails if the filesystem
+   * doesn't do direct I/O. */
+  int flags;
+
+  if ((flags = fcntl(fd, F_GETFL)) == -1)
+    return -1;
+  flags = on ? (flags | O_DIRECT) : (flags & ~O_DIRECT);
+  return fcntl(fd, F_SETFL, flags);
+}
+
+void directCRC64(int fd, uint64_t *crc, off_t *done)
+{ /* Hash from *done with O_DIRECT reads, which must already be turned
+   * on, until end of file.  Stops early on an error, leaving *crc and
+   * *done at the last good position, so the caller can finish (or report
+   * the error) with plain reads. */
+  ssize_t bufread;
+  double start;
+
+  if (*done % DIRECT_ALIGN)
+    return;
+  pthread_once(&directOnce, makeDirectKey);
+  if (directBuf == NULL)
+  {
+    if (posix_memalign((void **)&directBuf, DIRECT_ALIGN, DIRECT_CHUNK) != 0)
+    {
+      directBuf = NULL;
+      return;
+    }
+    pthread_setspecific(directKey, directBuf);
+  }
+
+  for (;;)
+  {
+    throttleIO(DIRECT_CHUNK);
+    start = ioStart();
+    bufread = pread(fd, directBuf, DIRECT_CHUNK, *done);
+    ioEnd(start);
+    if ((bufread == -1) && (errno == EINTR))
+      continue;
+    if (bufread <= 0)
+      break;
+    *crc = crc64(*crc, directBuf, bufread);
+    progressBytes(bufread);
+    *done += bufread;
+    if (bufread != DIRECT_CHUNK)
+      break; /* End of file, and *done is no longer aligned */
+  }
+}
+
+#define MMAP_STEP (1024 * 1024) /* Progress is recorded after each step */
+
+static __thread sigjmp_buf *mmapJump; /* Where to go if a mapped page can't be read */
+
+static void mmapFault(int sig)
+{ /* SIGBUS from touching a mapping past the end of a file that has
+   * shrunk, or a page that could not be read. */
+  if (mmapJump != NULL)
+    siglongjmp(*mmapJump, 1);
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+static void initMmap(void)
+{
+  struct sigaction action;
+
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = mmapFault;
+  action.sa_flags = SA_NODEFER; /* We leave the handler with siglongjmp() */
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGBUS, &action, NULL);
+}
+
+void mmapCRC64(int fd, off_t size, uint64_t *crc, off_t *done)
+{ /* Hash from *done to size straight out of the page cache, one window
+   * at a time.  Stops early if the mapping can't be made or read,
+   * leaving *crc and *done at the last good position, so the caller can
+   * finish (or report the error) with plain reads. */
+  sigjmp_buf jump;
+  volatile off_t pos = *done;
+  volatile uint64_t sum = *crc;
+  unsigned char *volatile map = MAP_FAILED;
+  volatile size_t mapLen = 0;
+  off_t start;
+  size_t off, step;
+  double begin;
+  long pageSize = sysconf(_SC_PAGESIZE);
+
+  if (sigsetjmp(jump, 0))
+  { /* The file shrank, or a page couldn't be read. */
+    mmapJump = NULL;
+    munmap(map, mapLen);
+    *crc = sum;
+    *done = pos;
+    return;
+  }
+  mmapJump = &jump;
+
+  while (pos < size)
+  {
+    start = pos - (pos % pageSize);
+    mapLen = ((size - start) < MMAP_WINDOW) ? (size - start) : MMAP_WINDOW;
+    if ((map = mmap(NULL, mapLen, PROT_READ, MAP_SHARED, fd, start)) == MAP_FAILED)
+      break;
+    /* Read the window ahead of us, and drop it from our mapping once used. */
+    madvise(map, mapLen, MADV_SEQUENTIAL);
+    if (!throttling) /* Reading the whole window now would get around the limits */
+      madvise(map, mapLen, MADV_WILLNEED);
+    for (off = pos - start; off < mapLen; off += step)
+    {
+      step = ((mapLen - off) < MMAP_STEP) ? (mapLen - off) : MMAP_STEP;
+      throttleIO(step);
+      begin = ioStart(); /* Page faults are where we wait */
+      sum = crc64(sum, map + off, step);
+      ioEnd(begin);
+      progressBytes(step);
+      pos += step;
+    }
+    munmap(map, mapLen);
+    map = MAP_FAILED;
+    if (scrubIO)
+      posix_fadvise(fd, start, mapLen, POSIX_FADV_DONTNEED);
+  }
+
+  mmapJump = NULL;
+  *crc = sum;
+  *done = pos;
+}
+
+#ifdef __NR_io_uring_setup
+
+enum slotStates { SLOT_FREE, SLOT_BUSY, SLOT_DONE };
+
+typedef struct {
+  unsigned char *buf;
+  off_t off;
+  unsigned int len;
+  int res;		/* Bytes read, or -errno */
+  uint64_t crc;		/* CRC of just this slot's data */
+  int state;
+} ioSlot;
+
+typedef struct {
+  int fd;
+  unsigned int *sqTail;
+  unsigned int *sqMask;
+  unsigned int *sqArray;
+  unsigned int *cqHead;
+  unsigned int *cqTail;
+  unsigned int *cqMask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sqRing;
+  void *cqRing;
+  size_t sqSize;
+  size_t cqSize;
+  size_t sqesSize;
+  int depth;
+  ioSlot slot[MAX_IO_DEPTH];
+  unsigned char *buffers;
+} ioRing;
+
+static pthread_key_t ringKey;
+static pthread_once_t ringOnce = PTHREAD_ONCE_INIT;
+static __thread ioRing *threadRing;
+
+static void freeRing(void *arg)
+{
+  ioRing *ring = arg;
+
+  if (ring->sqes != MAP_FAILED)
+    munmap(ring->sqes, ring->sqesSize);
+  if ((ring->cqRing != MAP_FAILED) && (ring->cqRing != ring->sqRing))
+    munmap(ring->cqRing, ring->cqSize);
+  if (ring->sqRing != MAP_FAILED)
+    munmap(ring->sqRing, ring->sqSize);
+  close(ring->fd);
+  free(ring->buffers);
+  free(ring);
+}
+
+static void makeRingKey(void)
+{ /* Rings are torn down as their thread exits. */
+  pthread_key_create(&ringKey, freeRing);
+}
+
+static ioRing *newRing(int depth)
+{ /* Set up a ring with depth entries, and a read buffer for each. */
+  struct io_uring_params params;
+  ioRing *ring;
+  int i;
+
+  if ((ring = calloc(1, sizeof(ioRing))) == NULL)
+    return NULL;
+  ring->sqRing = ring->cqRing = ring->sqes = MAP_FAILED;
+  memset(&params, 0, sizeof(params));
+  if ((ring->fd = syscall(__NR_io_uring_setup, depth, &params)) == -1)
+  {
+    free(ring);
+    return NULL;
+  }
+
+  ring->sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  ring->cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    if (ring->cqSize > ring->sqSize)
+      ring->sqSize = ring->cqSize;
+    ring->cqSize = ring->sqSize;
+  }
+  ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  ring->sqRing = mmap(NULL, ring->sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		      ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sqRing == MAP_FAILED)
+    goto fail;
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    ring->cqRing = ring->sqRing;
+  else if ((ring->cqRing = mmap(NULL, ring->cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				ring->fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+    goto fail;
+  ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		    ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED)
+    goto fail;
+
+  ring->sqTail = (unsigned int *)((char *)ring->sqRing + params.sq_off.tail);
+  ring->sqMask = (unsigned int *)((char *)ring->sqRing + params.sq_off.ring_mask);
+  ring->sqArray = (unsigned int *)((char *)ring->sqRing + params.sq_off.array);
+  ring->cqHead = (unsigned int *)((char *)ring->cqRing + params.cq_off.head);
+  ring->cqTail = (unsigned int *)((char *)ring->cqRing + params.cq_off.tail);
+  ring->cqMask = (unsigned int *)((char *)ring->cqRing + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)((char *)ring->cqRing + params.cq_off.cqes);
+
+  ring->depth = depth;
+  /* Aligned, so the same buffers do for O_DIRECT. */
+  if (posix_memalign((void **)&ring->buffers, DIRECT_ALIGN, (size_t)depth * IO_URING_CHUNK) != 0)
+  {
+    ring->buffers = NULL;
+    goto fail;
+  }
+  for (i = 0; i < depth; i++)
+    ring->slot[i].buf = ring->buffers + (size_t)i * IO_URING_CHUNK;
+  return ring;
+
+ fail:
+  freeRing(ring);
+  return NULL;
+}
+
+static int readSupported(int fd)
+{ /* IORING_OP_READ needs Linux 5.6.  Ask the kernel if it has it. */
+  struct io_uring_probe *probe;
+  int supported = 0;
+  size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+
+  if ((probe = calloc(1, size)) == NULL)
+    return 0;
+  if ((syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0) &&
+      (probe->last_op >= IORING_OP_READ))
+    supported = (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) != 0;
+  free(probe);
+  return supported;
+}
+
+int initIO(void)
+{ /* Check the chosen read engine works here, falling back to pread()
+   * if not.  Returns the mode that will be used. */
+  ioRing *ring;
+
+  if (ioMode == IO_MMAP)
+    initMmap();
+  if (ioMode == IO_URING)
+  {
+    if ((ring = newRing(ioDepth)) == NULL)
+      ioMode = IO_READ; /* No io_uring, or not allowed to use it */
+    else
+    {
+      if (!readSupported(ring->fd))
+	ioMode = IO_READ;
+      freeRing(ring);
+    }
+  }
+  if (ioMode == IO_URING)
+    pthread_once(&ringOnce, makeRingKey);
+  return ioMode;
+}
+
+static ioRing *getRing(void)
+{
+  if ((threadRing == NULL) && ((threadRing = newRing(ioDepth)) != NULL))
+    pthread_setspecific(ringKey, threadRing);
+  return threadRing;
+}
+
+static void dropRing(void)
+{ /* The ring is in an unknown state.  Stop using it.  Reads may still be
+   * in flight, so the buffers are left alone. */
+  pthread_setspecific(ringKey, NULL);
+  close(threadRing->fd);
+  threadRing = NULL;
+}
+
+void uringCRC64(int fd, off_t size, uint64_t *crc, off_t *done)
+{ /* Hash from *done to size with up to ioDepth reads in flight.  Each
+   * read is hashed as it completes, in whatever order, and the results
+   * joined in file order with crc64_combine().  Stops early at a short
+   * read or error, leaving *crc and *done at the last good position, so
+   * the caller can finish (or report the error) with plain reads. */
+  ioRing *ring;
+  ioSlot *slot;
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe *cqe;
+  off_t next = *done;
+  off_t dropped = *done;
+  unsigned int tail, head;
+  int first = 0, last = 0;	/* Oldest slot in flight, next slot to use */
+  int inflight = 0;
+  int toSubmit = 0;
+  int stop = 0;
+  int flags;
+  int ret;
+  double start;
+
+  if ((ring = getRing()) == NULL)
+    return;
+
+  /* O_NONBLOCK makes io_uring fail reads that would block, rather than wait. */
+  if (((flags = fcntl(fd, F_GETFL)) != -1) && (flags & O_NONBLOCK))
+    fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+
+  for (;;)
+  {
+    while (!stop && (inflight < ring->depth) && (next < size))
+    {
+      slot = &ring->slot[last];
+      slot->off = next;
+      slot->len = ((size - next) < IO_URING_CHUNK) ? (size - next) : IO_URING_CHUNK;
+      /* Round up for O_DIRECT.  The read just comes up short at the end of the file. */
+      slot->len = (slot->len + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+      slot->state = SLOT_BUSY;
+      throttleIO(slot->len);
+
+      tail = *ring->sqTail;
+      sqe = &ring->sqes[tail & *ring->sqMask];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = IORING_OP_READ;
+      sqe->fd = fd;
+      sqe->addr = (uintptr_t)slot->buf;
+      sqe->len = slot->len;
+      sqe->off = slot->off;
+      sqe->user_data = last;
+      ring->sqArray[tail & *ring->sqMask] = tail & *ring->sqMask;
+      __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+
+      next += slot->len;
+      if (next > size)
+	next = size;
+      last = (last + 1) % ring->depth;
+      ++inflight;
+      ++toSubmit;
+    }
+    if (inflight == 0)
+      break;
+
+    start = ioStart();
+    ret = syscall(__NR_io_uring_enter, ring->fd, toSubmit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    ioEnd(start);
+    if (ret == -1)
+    {
+      if ((errno != EINTR) && (errno != EAGAIN) && (errno != EBUSY))
+      {
+	dropRing();
+	return;
+      }
+    }
+    else
+      toSubmit -= ret;
+
+    head = *ring->cqHead;
+    while (head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE))
+    {
+      cqe = &ring->cqes[head & *ring->cqMask];
+      slot = &ring->slot[cqe->user_data];
+      slot->res = cqe->res;
+      if (slot->res > 0)
+	slot->crc = crc64(0, slot->buf, slot->res);
+      slot->state = SLOT_DONE;
+      ++head;
+    }
+    __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+
+    /* Join up everything that is now contiguous. */
+    while ((inflight > 0) && (ring->slot[first].state == SLOT_DONE))
+    {
+      slot = &ring->slot[first];
+      if (!stop)
+      {
+	if (slot->res > 0)
+	{
+	  *crc = crc64_combine(*crc, slot->crc, slot->res);
+	  progressBytes(slot->res);
+	  *done += slot->res;
+	  if (scrubIO && (*done - dropped >= SCRUB_DROP))
+	  { /* Don't leave what we have hashed in the page cache. */
+	    posix_fadvise(fd, dropped, *done - dropped, POSIX_FADV_DONTNEED);
+	    dropped = *done;
+	  }
+	}
+	if (slot->res != (int)slot->len)
+	  stop = 1; /* Short read or error.  Drain the rest and let the caller carry on. */
+      }
+      slot->state = SLOT_FREE;
+      first = (first + 1) % ring->depth;
+      --inflight;
+    }
+  }
+}
+
+#else /* No io_uring in these headers */
+
+int initIO(void)
+{
+  if (ioMode == IO_MMAP)
+    initMmap();
+  else
+    ioMode = IO_READ;
+  return ioMode;
+}
+
+void uringCRC64(int fd, off_t size, uint64_t *crc, off_t *done)
+{
+}
+
+#endif
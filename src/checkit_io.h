@@ -0,0 +1,46 @@
+/*  CHECKIT  
+    A file checksummer and integrity tester 
+    Copyright (C) 2014 Dennis Katsonis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <sys/types.h>
+
+enum ioModes {
+  IO_READ = 0,	/* Plain pread() */
+  IO_URING = 1,	/* io_uring, with several reads in flight */
+  IO_MMAP = 2	/* mmap(), where the file and filesystem suit it */
+};
+
+#define MAX_IO_DEPTH 256
+#define IO_URING_CHUNK (128 * 1024) /* Size of each io_uring read */
+#define MMAP_MIN_SIZE (256 * 1024) /* Smaller files are cheaper to read() */
+#define MMAP_WINDOW (64 * 1024 * 1024) /* How much of a file is mapped at once */
+#define DIRECT_ALIGN 4096 /* O_DIRECT buffer, offset and length alignment */
+#define DIRECT_CHUNK (1024 * 1024) /* Size of each O_DIRECT read */
+#define SCRUB_DROP (8 * 1024 * 1024) /* Drop cached pages every this many bytes */
+
+extern int ioMode;
+extern int ioDepth;
+extern int scrubIO;
+
+int ioModeByName(const char *name);
+const char *ioModeName(int mode);
+int initIO(void);
+int setDirect(int fd, int on);
+void directCRC64(int fd, uint64_t *crc, off_t *done);
+void uringCRC64(int fd, off_t size, uint64_t *crc, off_t *done);
+void mmapCRC64(int fd, off_t size, uint64_t *crc, off_t *done);
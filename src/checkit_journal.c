@@ -0,0 +1,238 @@
+/*  CHECKIT  
+    A file checksummer and integrity tester 
+    Copyright (C) 2014 Dennis Katsonis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Checkpoints of a recursive run, so an interrupted one can carry on
+ * from where it stopped.
+ *
+ * Results are printed in the order the walk reads directories, so what
+ * is finished is, in each directory the printing has got into, the
+ * entries up to some point in that order.  A checkpoint records that
+ * point for each of them: how many entries are finished and the name of
+ * the last, so a directory that changed since can be noticed.  A resumed
+ * run passes over finished entries as they are read, without looking at
+ * them.  The totals printed at the end are carried on from the
+ * checkpoint too, so they cover the whole run.
+ *
+ * The journal is replaced whole, by renaming a new copy over it, so a
+ * crash leaves either the old checkpoint or the new one. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "checkit.h"
+#include "checkit_journal.h"
+#include "checkit_output.h"
+
+#define JOURNAL_MAGIC "checkit journal 1"
+#define JOURNAL_FLAGS (STORE | CHECK | DISPLAY | REMOVE | RECURSE | EXPORT | IMPORT | SETCRCRO | SETCRCRW)
+
+/* The totals so far, carried on by a resumed run */
+extern int processed;
+extern int failed;
+extern int nocrc;
+extern int changed;
+
+int journaling = 0;
+static char *journalName = NULL;
+static char *tempName = NULL;
+static int journalFlags;
+static time_t nextCheckpoint;
+static journalLevel *resume = NULL;
+static int resumeLevels = 0;
+
+static time_t monotonicSeconds(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec;
+}
+
+static void putEscaped(FILE *out, const char *s)
+{ /* Names may hold anything but '\0'. */
+  for (; *s; s++)
+  {
+    if (*s == '\\')
+      fputs("\\\\", out);
+    else if (*s == '\t')
+      fputs("\\t", out);
+    else if (*s == '\n')
+      fputs("\\n", out);
+    else
+      putc(*s, out);
+  }
+}
+
+static char *getEscaped(char **s)
+{ /* Undo putEscaped() on the field at *s, in place, and move *s past it. */
+  char *field = *s;
+  char *in = field, *out = field;
+
+  while (*in && (*in != '\t') && (*in != '\n'))
+  {
+    if ((*in == '\\') && in[1])
+    {
+      ++in;
+      *out++ = (*in == 't') ? '\t' : (*in == 'n') ? '\n' : *in;
+      ++in;
+    }
+    else
+      *out++ = *in++;
+  }
+  *s = *in ? in + 1 : in;
+  *out = 0;
+  return field;
+}
+
+static int readJournal(FILE *in)
+{
+  char *line = NULL;
+  size_t size = 0;
+  char *ptr, *path, *last;
+  unsigned int flags;
+  journalLevel *level;
+  int ok = 0;
+
+  if ((getline(&line, &size, in) == -1) || (strncmp(line, JOURNAL_MAGIC "\n", sizeof(JOURNAL_MAGIC)) != 0))
+    goto out;
+  if ((getline(&line, &size, in) == -1) || (sscanf(line, "flags %x", &flags) != 1))
+    goto out;
+  if ((flags & JOURNAL_FLAGS) != (journalFlags & JOURNAL_FLAGS))
+  {
+    fprintf(statusStream(), "The journal is from a run with different options.\n");
+    exit(1);
+  }
+  while (getline(&line, &size, in) != -1)
+  {
+    if (sscanf(line, "totals %d %d %d %d", &processed, &failed, &nocrc, &changed) == 4)
+      continue;
+    resume = realloc(resume, (resumeLevels + 1) * sizeof(journalLevel));
+    if (resume == NULL)
+    {
+      perror("Could not allocate memory :");
+      exit(ERROR_NO_MEM);
+    }
+    level = &resume[resumeLevels];
+    level->done = strtoll(line, &ptr, 10);
+    if ((*ptr++ != '\t') || (level->done <= 0))
+      goto out;
+    path = strdup(getEscaped(&ptr));
+    last = strdup(getEscaped(&ptr));
+    if ((path == NULL) || (last == NULL))
+    {
+      perror("Could not allocate memory :");
+      exit(ERROR_NO_MEM);
+    }
+    level->path = path;
+    level->last = last;
+    ++resumeLevels;
+  }
+  ok = 1;
+out:
+  free(line);
+  return ok;
+}
+
+int openJournal(const char *name, int flags, int resuming)
+{ /* Checkpoint to the journal name, first reading where to carry on
+   * from if resuming.  A missing journal means starting afresh. */
+  FILE *in;
+
+  journalName = strdup(name);
+  tempName = malloc(strlen(name) + 5);
+  if ((journalName == NULL) || (tempName == NULL))
+    return ERROR_NO_MEM;
+  sprintf(tempName, "%s.new", name);
+  journalFlags = flags;
+  journaling = 1;
+  nextCheckpoint = monotonicSeconds() + JOURNAL_INTERVAL;
+
+  if (!resuming)
+    return SUCCESS;
+  if ((in = fopen(name, "r")) == NULL)
+  {
+    if (errno != ENOENT)
+      return ERROR_OPEN_FILE;
+    fprintf(statusStream(), "No journal in %s, starting from the beginning.\n", name);
+    return SUCCESS;
+  }
+  if (!readJournal(in))
+  {
+    fclose(in);
+    return ERROR_READ_FILE;
+  }
+  fclose(in);
+  return SUCCESS;
+}
+
+int journalDue(void)
+{
+  return monotonicSeconds() >= nextCheckpoint;
+}
+
+void writeJournal(const journalLevel *level, int levels)
+{ /* Replace the checkpoint.  If it can't be written, the last one
+   * stands. */
+  FILE *out;
+  int i, ok;
+
+  nextCheckpoint = monotonicSeconds() + JOURNAL_INTERVAL;
+  if ((out = fopen(tempName, "w")) == NULL)
+    return;
+  fprintf(out, JOURNAL_MAGIC "\nflags %x\n", (unsigned int)journalFlags);
+  fprintf(out, "totals %d %d %d %d\n", processed, failed, nocrc, changed);
+  for (i = 0; i < levels; i++)
+  {
+    fprintf(out, "%lld\t", level[i].done);
+    putEscaped(out, level[i].path);
+    putc('\t', out);
+    putEscaped(out, level[i].last);
+    putc('\n', out);
+  }
+  ok = (fflush(out) == 0) && (fsync(fileno(out)) == 0);
+  if ((fclose(out) == 0) && ok)
+    rename(tempName, journalName);
+  else
+    unlink(tempName);
+}
+
+long long resumePoint(const char *path, const char **last)
+{ /* How many entries of directory path a resumed run can pass over, and
+   * the name of the last of them. */
+  int i;
+
+  for (i = 0; i < resumeLevels; i++)
+  {
+    if ((resume[i].done > 0) && (strcmp(resume[i].path, path) == 0))
+    {
+      *last = resume[i].last;
+      return resume[i].done;
+    }
+  }
+  return 0;
+}
+
+void closeJournal(void)
+{ /* The run is complete, so there is nothing left to resume. */
+  unlink(journalName);
+  journaling = 0;
+}
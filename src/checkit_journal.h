@@ -0,0 +1,33 @@
+/*  CHECKIT  
+    A file checksummer and integrity tester 
+    Copyright (C) 2014 Dennis Katsonis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define JOURNAL_INTERVAL 30 /* Seconds between checkpoints */
+
+typedef struct {
+  const char *path;	/* Directory, as the walk prints it ("" for the command line) */
+  long long done;	/* Entries finished, in the order they were read */
+  const char *last;	/* Name of the last one finished */
+} journalLevel;
+
+extern int journaling;
+
+int openJournal(const char *name, int flags, int resume);
+int journalDue(void);
+void writeJournal(const journalLevel *level, int levels);
+long long resumePoint(const char *path, const char **last);
+void closeJournal(void);
@@ -0,0 +1,126 @@
+/*  CHECKIT  
+    A file checksummer and integrity tester 
+    Copyright (C) 2014 Dennis Katsonis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* What is printed for each file.
+ *
+ * Results are printed as text, coloured only on a terminal, or as
+ * records for other programs to read.  Either way, stdout is written in
+ * large blocks unless it is a terminal.  Quiet leaves out files that
+ * were fine. */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "checkit.h"
+#include "checkit_output.h"
+
+int outputFormat = FORMAT_TEXT;
+int quiet = 0;
+int colour = 0;
+
+int outputFormatByName(const char *name)
+{
+  if (strcmp(name, "text") == 0)
+    return FORMAT_TEXT;
+  if (strcmp(name, "json") == 0)
+    return FORMAT_JSON;
+  if (strcmp(name, "nul") == 0)
+    return FORMAT_NUL;
+  return -1;
+}
+
+FILE *statusStream(void)
+{ /* Where messages that aren't about a file go: out of the way of the
+   * records, if printing those. */
+  return (outputFormat == FORMAT_TEXT) ? stdout : stderr;
+}
+
+void initOutput(void)
+{ /* Before anything is printed. */
+  if (isatty(STDOUT_FILENO))
+    colour = 1;
+  else
+    setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER);
+}
+
+static void putJSONString(FILE *out, const char *s)
+{ /* Bytes that aren't ASCII are passed through as they are. */
+  putc('"', out);
+  for (; *s; s++)
+  {
+    if ((*s == '"') || (*s == '\\'))
+      fprintf(out, "\\%c", *s);
+    else if ((unsigned char)*s < 0x20)
+      fprintf(out, "\\u%04x", (unsigned char)*s);
+    else
+      putc(*s, out);
+  }
+  putc('"', out);
+}
+
+static void putJSONCRC(FILE *out, const char *name, int have, t_crc64 crc)
+{ /* As a hex string, as JSON numbers can't be trusted with 64 bits. */
+  if (have)
+    fprintf(out, ",\"%s\":\"%016llx\"", name, crc);
+  else
+    fprintf(out, ",\"%s\":null", name);
+}
+
+void writeReport(FILE *out, const char *path, const fileReport *report)
+{ /* out is an open_memstream() holding the text printed for the file.
+   * Replace it with a record, if that is the format, and drop it if
+   * quiet and the file was fine.  The stream ends where it is left. */
+  int problem = (report->status != NULL) && (strcmp(report->status, "OK") != 0);
+
+  if ((outputFormat == FORMAT_TEXT) && (problem || !quiet))
+    return;
+  fseeko(out, 0, SEEK_SET);
+  if ((outputFormat == FORMAT_TEXT) || (report->status == NULL) || (quiet && !problem))
+    return;
+
+  if (outputFormat == FORMAT_JSON)
+  {
+    fputs("{\"path\":", out);
+    putJSONString(out, path);
+    fputs(",\"status\":", out);
+    putJSONString(out, report->status);
+    putJSONCRC(out, "stored", report->haveStored, report->stored);
+    putJSONCRC(out, "computed", report->haveComputed, report->computed);
+    fprintf(out, ",\"bytes\":%llu,\"seconds\":%.6f", (unsigned long long)report->bytes, report->seconds);
+    if (report->error)
+    {
+      fputs(",\"error\":", out);
+      putJSONString(out, errorMessage(report->error));
+    }
+    fputs("}\n", out);
+  }
+  else
+  { /* Path, status, stored, computed, bytes, seconds, error.  Empty if
+     * not known. */
+    fprintf(out, "%s%c%s%c", path, 0, report->status, 0);
+    if (report->haveStored)
+      fprintf(out, "%016llx", report->stored);
+    putc(0, out);
+    if (report->haveComputed)
+      fprintf(out, "%016llx", report->computed);
+    putc(0, out);
+    fprintf(out, "%llu%c%.6f%c%s%c", (unsigned long long)report->bytes, 0, report->seconds, 0,
+	    report->error ? errorMessage(report->error) : "", 0);
+  }
+}
@@ -0,0 +1,48 @@
+/*  CHECKIT  
+    A file checksummer and integrity tester 
+    Copyright (C) 2014 Dennis Katsonis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define OUTPUT_BUFFER (1024 * 1024) /* stdout buffer when it isn't a terminal */
+
+enum outputFormats
+{
+  FORMAT_TEXT,
+  FORMAT_JSON,	/* One JSON object per line */
+  FORMAT_NUL	/* Seven fields per file, each ended by a NUL */
+};
+
+typedef struct {
+  const char *status;	/* "OK", "FAILED", "NO CRC", "CHANGED" or "ERROR", NULL if nothing to report */
+  int error;		/* From enum errorTypes */
+  int haveStored;
+  t_crc64 stored;
+  int haveComputed;
+  t_crc64 computed;
+  uint64_t bytes;
+  double seconds;
+} fileReport;
+
+extern int outputFormat;
+extern int quiet;
+
+int outputFormatByName(const char *name);
+void initOutput(void);
+FILE *statusStream(void);
+void writeReport(FILE *out, const char *path, const fileReport *report);
@@ -0,0 +1,339 @@
+/*  CHECKIT  
+    A file checksummer and integrity tester 
+    Copyright (C) 2014 Dennis Katsonis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Worker threads for directory scanning and file processing.
+ *
+ * Directory tasks go on a per worker deque.  A worker pushes the
+ * subdirectories it finds on the bottom of its own deque and pops from
+ * the bottom, so it walks depth first.  Idle workers steal from the top
+ * of other deques, which holds the oldest and usually largest subtrees.
+ * Tasks pushed by a thread that is not a worker go on a shared deque.
+ *
+ * File tasks go on a queue for their lane (normally one per disk), in
+ * the order they were found, which is close to the order their results
+ * are printed.  Each lane has a limit on how many of its files are
+ * processed at once, and workers take files from the lanes in turn, so
+ * every disk is kept busy without thrashing any of them.  Once too many
+ * files are waiting, workers take files ahead of directories so the scan
+ * does not run too far ahead of the hashing.
+ *
+ * With no worker threads, nothing runs until the caller asks for it with
+ * runPendingTask(). */
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "checkit.h"
+#include "checkit_pool.h"
+
+#define FILE_BACKLOG 1024 /* Queued files per worker before scanning pauses */
+
+typedef struct {
+  pthread_mutex_t lock;
+  poolTask *top;	/* Oldest, stolen from here */
+  poolTask *bottom;	/* Newest, owner works here */
+} taskDeque;
+
+static int workers = 0;
+static pthread_t workerThread[MAX_WORKERS];
+static taskDeque deque[MAX_WORKERS + 1]; /* Last one is shared */
+static __thread int workerId = -1;
+
+typedef struct {
+  poolTask *head;
+  poolTask *tail;
+  int active;		/* Its files being processed now */
+  int limit;		/* Most that may be processed at once, 0 for no limit */
+} fileLane;
+
+static pthread_mutex_t fileLock = PTHREAD_MUTEX_INITIALIZER;
+static fileLane lane[MAX_LANES];	/* Lane 0 is for files of no particular disk */
+static int lanes = 1;
+static int nextLane = 0;		/* Where the next look for a file starts */
+static int fileCount = 0;
+
+static pthread_mutex_t idleLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idleCond = PTHREAD_COND_INITIALIZER;
+static int queued = 0;		/* Tasks on any deque or queue */
+static unsigned int wakeups = 0; /* Bumped whenever there may be something new to run */
+static int idle = 0;		/* Workers waiting for a task */
+static int stopping = 0;
+
+static void signalWorker(void)
+{
+  __atomic_add_fetch(&wakeups, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&idle, __ATOMIC_SEQ_CST) > 0)
+  {
+    pthread_mutex_lock(&idleLock);
+    pthread_cond_signal(&idleCond);
+    pthread_mutex_unlock(&idleLock);
+  }
+}
+
+static void wakeWorker(void)
+{
+  __atomic_add_fetch(&queued, 1, __ATOMIC_SEQ_CST);
+  signalWorker();
+}
+
+static poolTask *dequeTake(taskDeque *d, int fromTop)
+{
+  poolTask *task;
+
+  pthread_mutex_lock(&d->lock);
+  task = fromTop ? d->top : d->bottom;
+  if (task != NULL)
+  {
+    if (fromTop)
+    {
+      d->top = task->next;
+      if (d->top != NULL)
+	d->top->prev = NULL;
+      else
+	d->bottom = NULL;
+    }
+    else
+    {
+      d->bottom = task->prev;
+      if (d->bottom != NULL)
+	d->bottom->next = NULL;
+      else
+	d->top = NULL;
+    }
+  }
+  pthread_mutex_unlock(&d->lock);
+  return task;
+}
+
+static poolTask *takeFile(void)
+{ /* The next file from a lane that has room for another. */
+  poolTask *task = NULL;
+  fileLane *l;
+  int i;
+
+  if (__atomic_load_n(&fileCount, __ATOMIC_RELAXED) == 0)
+    return NULL;
+  pthread_mutex_lock(&fileLock);
+  for (i = 0; (task == NULL) && (i < lanes); i++)
+  {
+    l = &lane[(nextLane + i) % lanes];
+    if ((l->head == NULL) || (l->limit && (l->active >= l->limit)))
+      continue;
+    task = l->head;
+    l->head = task->next;
+    if (l->head == NULL)
+      l->tail = NULL;
+    ++l->active;
+    __atomic_sub_fetch(&fileCount, 1, __ATOMIC_RELAXED);
+    nextLane = (nextLane + i + 1) % lanes;
+  }
+  pthread_mutex_unlock(&fileLock);
+  return task;
+}
+
+static void fileDone(int id)
+{ /* Called once a file from lane id has been processed.  The lane may
+   * now have room for another. */
+  int wasFull;
+
+  pthread_mutex_lock(&fileLock);
+  wasFull = lane[id].limit && (lane[id].active-- == lane[id].limit) && (lane[id].head != NULL);
+  pthread_mutex_unlock(&fileLock);
+  if (wasFull)
+    signalWorker();
+}
+
+static void runTask(poolTask *task)
+{
+  int id = task->lane; /* Running it may free the task */
+
+  task->run(task);
+  if (id >= 0)
+    fileDone(id);
+}
+
+static poolTask *takeDir(int self)
+{
+  poolTask *task = NULL;
+  int i;
+
+  if (self >= 0)
+    task = dequeTake(&deque[self], 0);
+  if (task == NULL)
+    task = dequeTake(&deque[workers], 0);
+  for (i = 1; (task == NULL) && (i < workers); i++)
+  { /* Steal, starting with our neighbour so thieves spread out. */
+    task = dequeTake(&deque[(self + i) % workers], 1);
+  }
+  return task;
+}
+
+static poolTask *takeTask(int self)
+{
+  poolTask *task;
+
+  if (__atomic_load_n(&fileCount, __ATOMIC_RELAXED) > FILE_BACKLOG * (workers ? workers : 1))
+  {
+    if ((task = takeFile()) == NULL)
+      task = takeDir(self);
+  }
+  else if ((task = takeDir(self)) == NULL)
+    task = takeFile();
+
+  if (task != NULL)
+    __atomic_sub_fetch(&queued, 1, __ATOMIC_SEQ_CST);
+  return task;
+}
+
+static void *poolWorker(void *arg)
+{
+  poolTask *task;
+  unsigned int seen;
+
+  workerId = (int)(long)arg;
+  for (;;)
+  {
+    seen = __atomic_load_n(&wakeups, __ATOMIC_SEQ_CST);
+    if ((task = takeTask(workerId)) != NULL)
+    {
+      runTask(task);
+      continue;
+    }
+    /* Nothing we can run.  Wait until something is queued, or a lane
+     * that was full has room. */
+    pthread_mutex_lock(&idleLock);
+    __atomic_add_fetch(&idle, 1, __ATOMIC_SEQ_CST);
+    while ((__atomic_load_n(&wakeups, __ATOMIC_SEQ_CST) == seen) && !stopping)
+      pthread_cond_wait(&idleCond, &idleLock);
+    __atomic_sub_fetch(&idle, 1, __ATOMIC_SEQ_CST);
+    if (stopping && (__atomic_load_n(&queued, __ATOMIC_SEQ_CST) == 0))
+    {
+      pthread_mutex_unlock(&idleLock);
+      break;
+    }
+    pthread_mutex_unlock(&idleLock);
+  }
+  return NULL;
+}
+
+int initPool(int threads)
+{ /* With one thread, no workers are started and the caller runs tasks
+   * itself. */
+  int i;
+
+  for (i = 0; i <= MAX_WORKERS; i++)
+  {
+    pthread_mutex_init(&deque[i].lock, NULL);
+    deque[i].top = deque[i].bottom = NULL;
+  }
+  if (threads <= 1)
+    return SUCCESS;
+  if (threads > MAX_WORKERS)
+    threads = MAX_WORKERS;
+
+  workers = threads; /* The shared deque is the one after the workers' own. */
+  for (i = 0; i < threads; i++)
+  {
+    if (pthread_create(&workerThread[i], NULL, poolWorker, (void *)(long)i) != 0)
+      return ERROR_NO_MEM;
+  }
+  return SUCCESS;
+}
+
+int poolWorkers(void)
+{
+  return workers;
+}
+
+int addLane(int limit)
+{ /* A new lane for files, processing no more than limit of them at
+   * once (0 for no limit).  If there are too many lanes, files share
+   * the default lane, 0. */
+  int id = 0;
+
+  pthread_mutex_lock(&fileLock);
+  if (lanes < MAX_LANES)
+  {
+    id = lanes++;
+    lane[id].limit = limit;
+  }
+  pthread_mutex_unlock(&fileLock);
+  return id;
+}
+
+void pushDirTask(poolTask *task)
+{
+  taskDeque *d = &deque[(workerId >= 0) ? workerId : workers];
+
+  task->lane = -1;
+  task->next = NULL;
+  pthread_mutex_lock(&d->lock);
+  task->prev = d->bottom;
+  if (d->bottom != NULL)
+    d->bottom->next = task;
+  else
+    d->top = task;
+  d->bottom = task;
+  pthread_mutex_unlock(&d->lock);
+  wakeWorker();
+}
+
+void pushFileTask(poolTask *task, int id)
+{
+  task->lane = id;
+  task->next = NULL;
+  pthread_mutex_lock(&fileLock);
+  if (lane[id].tail != NULL)
+    lane[id].tail->next = task;
+  else
+    lane[id].head = task;
+  lane[id].tail = task;
+  __atomic_add_fetch(&fileCount, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&fileLock);
+  wakeWorker();
+}
+
+int runPendingTask(void)
+{ /* Run one queued task on the calling thread.  Returns 0 if there was
+   * nothing to run.  Queued files go first, so the results the caller is
+   * waiting for are produced in roughly the order they are needed. */
+  poolTask *task;
+
+  if ((task = takeFile()) == NULL)
+    task = takeDir(workerId);
+  if (task == NULL)
+    return 0;
+  __atomic_sub_fetch(&queued, 1, __ATOMIC_SEQ_CST);
+  runTask(task);
+  return 1;
+}
+
+void finishPool(void)
+{
+  int i;
+
+  if (workers == 0)
+    return;
+  pthread_mutex_lock(&idleLock);
+  stopping = 1;
+  pthread_cond_broadcast(&idleCond);
+  pthread_mutex_unlock(&idleLock);
+  for (i = 0; i < workers; i++)
+    pthread_join(workerThread[i], NULL);
+  workers = 0;
+}
@@ -0,0 +1,36 @@
+/*  CHECKIT  
+    A file checksummer and integrity tester 
+    Copyright (C) 2014 Dennis Katsonis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define MAX_WORKERS 256
+
+#define MAX_LANES 64
+
+typedef struct poolTask {
+  void (*run)(struct poolTask *task);
+  struct poolTask *next;
+  struct poolTask *prev;
+  int lane;		/* File tasks only */
+} poolTask;
+
+int initPool(int workers);
+int poolWorkers(void);
+void pushDirTask(poolTask *task);
+int addLane(int limit);
+void pushFileTask(poolTask *task, int lane);
+int runPendingTask(void);
+void finishPool(void);
@@ -0,0 +1,368 @@
+/*  CHECKIT  
+    A file checksummer and integrity tester 
+    Copyright (C) 2014 Dennis Katsonis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Progress of a long run, printed to stderr every so often or when
+ * asked with SIGUSR1 (or SIGINFO, where there is one).
+ *
+ * Bytes are counted by each thread in a slot of its own as it reads, so
+ * large files show as they go, without threads contending for a counter.
+ * Data not read because it was unchanged, a hole or the same as another
+ * file's is counted too.  Files are counted as each is finished.  The
+ * total to go by is, best first, what a schedule chose, what a pre-scan
+ * of the files named counted, or the space and inodes used on the
+ * filesystems, when whole filesystems are being gone through.  Without
+ * one, only the rates are printed.
+ *
+ * The signals are blocked in every thread, and a thread of our own
+ * waits for them, so a report never interrupts a read.  None of this
+ * happens unless progress reports were asked for. */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "checkit.h"
+#include "checkit_progress.h"
+
+#define PRESCAN_FDS 64 /* Directories nftw() may hold open */
+
+enum progressTotals
+{
+  TOTAL_NONE,		/* Nothing to go by */
+  TOTAL_ESTIMATE,	/* From the filesystems' usage */
+  TOTAL_COUNTING,	/* Pre-scan still going, so far */
+  TOTAL_KNOWN
+};
+
+static pthread_t reporter;
+static pthread_t counter;
+static int reporting = 0;
+static int counting = 0;
+static int stopping = 0;
+int progressing = 0;		/* Reports asked for, so count */
+static int every;		/* Seconds between reports, 0 for only when asked */
+static sigset_t progressSignals;
+static struct timespec started;
+
+static uint64_t doneFiles = 0;
+static progressSlot *slots = NULL; /* Never freed, but reused by new threads */
+static pthread_mutex_t slotLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t slotOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t slotKey;
+__thread progressSlot *progressMine = NULL;
+static uint64_t totalFiles = 0;
+static uint64_t totalBytes = 0;
+static int totalKind = TOTAL_NONE;
+
+static char **scanPaths;
+static int scanCount;
+static int scanFlags;
+
+static void freeSlot(void *slot)
+{ /* At thread exit.  What it counted stays counted. */
+  __atomic_store_n(&((progressSlot *)slot)->free, 1, __ATOMIC_RELEASE);
+}
+
+static void makeSlotKey(void)
+{
+  pthread_key_create(&slotKey, freeSlot);
+}
+
+progressSlot *progressClaim(void)
+{ /* A slot for the calling thread: one left by a thread that has
+   * finished, or a new one. */
+  progressSlot *slot;
+
+  pthread_once(&slotOnce, makeSlotKey);
+  pthread_mutex_lock(&slotLock);
+  for (slot = slots; slot != NULL; slot = slot->next)
+    if (__atomic_load_n(&slot->free, __ATOMIC_ACQUIRE))
+      break;
+  if (slot == NULL)
+  {
+    if ((slot = calloc(1, sizeof(progressSlot))) == NULL)
+    {
+      perror("Could not allocate memory :");
+      exit(ERROR_NO_MEM);
+    }
+    slot->next = slots;
+    __atomic_store_n(&slots, slot, __ATOMIC_RELEASE);
+  }
+  slot->free = 0;
+  pthread_mutex_unlock(&slotLock);
+  pthread_setspecific(slotKey, slot);
+  return slot;
+}
+
+static uint64_t bytesDone(void)
+{
+  progressSlot *slot;
+  uint64_t bytes = 0;
+
+  for (slot = __atomic_load_n(&slots, __ATOMIC_ACQUIRE); slot != NULL; slot = slot->next)
+    bytes += __atomic_load_n(&slot->bytes, __ATOMIC_RELAXED);
+  return bytes;
+}
+
+static void formatBytes(char *buf, size_t size, double bytes)
+{ /* Decimal units, like the rate. */
+  const char *unit = " kMGTPE";
+  int i;
+
+  for (i = 0; (bytes >= 1000) && unit[i + 1]; i++)
+    bytes /= 1000;
+  if (i == 0)
+    snprintf(buf, size, "%.0f B", bytes);
+  else
+    snprintf(buf, size, "%.1f %cB", bytes, unit[i]);
+}
+
+static void printProgress(void)
+{
+  struct timespec now;
+  char done[32], total[32];
+  uint64_t files = __atomic_load_n(&doneFiles, __ATOMIC_RELAXED);
+  uint64_t bytes = bytesDone();
+  uint64_t ofFiles = __atomic_load_n(&totalFiles, __ATOMIC_RELAXED);
+  uint64_t ofBytes = __atomic_load_n(&totalBytes, __ATOMIC_RELAXED);
+  int kind = __atomic_load_n(&totalKind, __ATOMIC_ACQUIRE);
+  const char *about = (kind == TOTAL_ESTIMATE) ? "~" : "";
+  double seconds, left;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  seconds = (now.tv_sec - started.tv_sec) + (now.tv_nsec - started.tv_nsec) / 1e9;
+  if (seconds <= 0)
+    seconds = 1e-9;
+  formatBytes(done, sizeof(done), bytes);
+  formatBytes(total, sizeof(total), ofBytes);
+
+  if (kind == TOTAL_NONE)
+    fprintf(stderr, "Progress: %llu file(s), %s", (unsigned long long)files, done);
+  else
+    fprintf(stderr, "Progress: %llu of %s%llu%s file(s), %s of %s%s", (unsigned long long)files,
+	    about, (unsigned long long)ofFiles, (kind == TOTAL_COUNTING) ? "+" : "", done, about, total);
+  if ((kind != TOTAL_NONE) && (kind != TOTAL_COUNTING) && (ofBytes > 0))
+    fprintf(stderr, " (%.0f%%)", (bytes < ofBytes) ? 100.0 * bytes / ofBytes : 100.0);
+  fprintf(stderr, ", %.1f file(s)/s, %.1f MB/s", files / seconds, bytes / seconds / 1e6);
+
+  /* Going by bytes, unless there are none, as with only empty files. */
+  left = -1;
+  if ((kind == TOTAL_KNOWN) || (kind == TOTAL_ESTIMATE))
+  {
+    if ((ofBytes > 0) && (bytes > 0))
+      left = (bytes < ofBytes) ? (ofBytes - bytes) * seconds / bytes : 0;
+    else if ((ofFiles > 0) && (files > 0))
+      left = (files < ofFiles) ? (ofFiles - files) * seconds / files : 0;
+  }
+  if (left >= 0)
+    fprintf(stderr, ", ETA %dh%02dm%02ds", (int)(left / 3600), (int)left / 60 % 60, (int)left % 60);
+  else if (kind == TOTAL_COUNTING)
+    fputs(", still counting", stderr);
+  fputc('\n', stderr);
+}
+
+static void *reportProgress(void *arg)
+{
+  struct timespec wait;
+  int sig;
+
+  (void)arg;
+  for (;;)
+  {
+    if (every > 0)
+    {
+      wait.tv_sec = every;
+      wait.tv_nsec = 0;
+      sig = sigtimedwait(&progressSignals, NULL, &wait);
+    }
+    else
+      sig = sigwaitinfo(&progressSignals, NULL);
+    if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE))
+      break;
+    if ((sig != -1) || (errno == EAGAIN))
+      printProgress();
+  }
+  return NULL;
+}
+
+static int countFile(const char *path, const struct stat *statbuf, int type, struct FTW *ftw)
+{ /* The files that will be processed: regular and not hidden. */
+  if (__atomic_load_n(&stopping, __ATOMIC_RELAXED) ||
+      (__atomic_load_n(&totalKind, __ATOMIC_RELAXED) != TOTAL_COUNTING))
+    return 1; /* Finished, or a schedule has said what the total is */
+  if ((type == FTW_F) && S_ISREG(statbuf->st_mode) && (path[ftw->base] != '.'))
+  {
+    __atomic_add_fetch(&totalFiles, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&totalBytes, statbuf->st_size, __ATOMIC_RELAXED);
+  }
+  return 0;
+}
+
+static void *prescan(void *arg)
+{ /* Follows symbolic links, as the walk does. */
+  struct stat statbuf;
+  struct FTW ftw;
+  const char *base;
+  int i;
+
+  (void)arg;
+  for (i = 0; i < scanCount; i++)
+  {
+    if (stat(scanPaths[i], &statbuf) != 0)
+      continue;
+    if (S_ISDIR(statbuf.st_mode) && (scanFlags & RECURSE))
+      nftw(scanPaths[i], countFile, PRESCAN_FDS, 0);
+    else
+    {
+      base = strrchr(scanPaths[i], '/');
+      ftw.base = base ? base + 1 - scanPaths[i] : 0;
+      if (countFile(scanPaths[i], &statbuf, FTW_F, &ftw))
+	break;
+    }
+  }
+  /* A schedule's total takes over from a pre-scan. */
+  i = TOTAL_COUNTING;
+  __atomic_compare_exchange_n(&totalKind, &i, TOTAL_KNOWN, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+static int wholeFilesystem(const char *path)
+{ /* Is path the root of the filesystem it is on? */
+  struct stat self, parent;
+  char *up;
+  int result;
+
+  if ((up = malloc(strlen(path) + 4)) == NULL)
+    return 0;
+  strcpy(up, path);
+  strcat(up, "/..");
+  result = (stat(path, &self) == 0) && (stat(up, &parent) == 0) &&
+    ((self.st_dev != parent.st_dev) || (self.st_ino == parent.st_ino));
+  free(up);
+  return result;
+}
+
+static void estimateTotal(char **paths, int count, int flags)
+{ /* Files named are known exactly.  Directories can only be guessed at
+   * from the filesystem's usage, when they are the whole of one. */
+  struct statvfs fs;
+  struct stat statbuf;
+  unsigned long seen[count];
+  int estimate = 0;
+  int i, j;
+
+  if (count == 0)
+    return;
+  for (i = 0; i < count; i++)
+  {
+    seen[i] = 0;
+    if (stat(paths[i], &statbuf) != 0)
+      continue;
+    if (S_ISREG(statbuf.st_mode))
+    {
+      ++totalFiles;
+      totalBytes += statbuf.st_size;
+      continue;
+    }
+    if (!S_ISDIR(statbuf.st_mode) || !(flags & RECURSE))
+      continue;
+    if (!wholeFilesystem(paths[i]) || (statvfs(paths[i], &fs) != 0) || (fs.f_fsid == 0))
+      return; /* Nothing to go by */
+    for (j = 0; (j < i) && (seen[j] != fs.f_fsid); j++)
+      ;
+    seen[i] = fs.f_fsid;
+    if (j < i)
+      continue; /* Counted it already */
+    totalFiles += fs.f_files - fs.f_ffree;
+    totalBytes += (uint64_t)(fs.f_blocks - fs.f_bfree) * fs.f_frsize;
+    estimate = 1;
+  }
+  totalKind = estimate ? TOTAL_ESTIMATE : TOTAL_KNOWN;
+}
+
+void startProgress(char **paths, int count, int flags, int interval, int prescanning)
+{ /* Call before any other threads are started, so they all inherit the
+   * blocked signals.  paths are the files and directories to be gone
+   * through, if known, and must last until stopProgress().  Does
+   * nothing without an interval or prescanning. */
+  if (!interval && !prescanning)
+    return;
+  progressing = 1;
+  clock_gettime(CLOCK_MONOTONIC, &started);
+  every = interval;
+  sigemptyset(&progressSignals);
+  sigaddset(&progressSignals, PROGRESS_SIGNAL);
+#ifdef SIGINFO
+  sigaddset(&progressSignals, SIGINFO);
+#endif
+  pthread_sigmask(SIG_BLOCK, &progressSignals, NULL);
+
+  if (prescanning && (count > 0))
+  {
+    scanPaths = paths;
+    scanCount = count;
+    scanFlags = flags;
+    totalKind = TOTAL_COUNTING;
+    counting = (pthread_create(&counter, NULL, prescan, NULL) == 0);
+    if (!counting)
+      totalKind = TOTAL_NONE;
+  }
+  if (!counting)
+    estimateTotal(paths, count, flags);
+  if (pthread_create(&reporter, NULL, reportProgress, NULL) == 0)
+    reporting = 1;
+  else /* Leave the signals as they were */
+    pthread_sigmask(SIG_UNBLOCK, &progressSignals, NULL);
+}
+
+void progressFile(void)
+{ /* Called once each file is done with. */
+  if (progressing)
+    __atomic_add_fetch(&doneFiles, 1, __ATOMIC_RELAXED);
+}
+
+void setProgressTotal(uint64_t files, uint64_t bytes)
+{ /* All there is to do, once it is known for sure. */
+  __atomic_store_n(&totalFiles, files, __ATOMIC_RELAXED);
+  __atomic_store_n(&totalBytes, bytes, __ATOMIC_RELAXED);
+  __atomic_store_n(&totalKind, TOTAL_KNOWN, __ATOMIC_RELEASE);
+}
+
+void stopProgress(void)
+{
+  __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+  if (reporting)
+  {
+    pthread_kill(reporter, PROGRESS_SIGNAL);
+    pthread_join(reporter, NULL);
+    reporting = 0;
+  }
+  if (counting)
+  {
+    pthread_join(counter, NULL);
+    counting = 0;
+  }
+}
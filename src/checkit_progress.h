@@ -0,0 +1,42 @@
+/*  CHECKIT  
+    A file checksummer and integrity tester 
+    Copyright (C) 2014 Dennis Katsonis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define PROGRESS_SIGNAL SIGUSR1	/* Prints the progress so far */
+
+typedef struct progressSlot {
+  uint64_t bytes;	/* Written only by the thread holding it */
+  int free;		/* Its thread has finished */
+  struct progressSlot *next;
+} progressSlot;
+
+extern int progressing;
+extern __thread progressSlot *progressMine;
+
+/* Count bytes of files done with by this thread, read or passed over.
+ * Called for each read, so it is just a store to the thread's own slot. */
+#define progressBytes(n)	do { if (progressing) { if (progressMine == NULL) progressMine = progressClaim(); \
+      __atomic_store_n(&progressMine->bytes, progressMine->bytes + (n), __ATOMIC_RELAXED); } } while (0)
+
+void startProgress(char **paths, int count, int flags, int interval, int prescan);
+progressSlot *progressClaim(void);
+void progressFile(void);
+void setProgressTotal(uint64_t files, uint64_t bytes);
+void stopProgress(void);
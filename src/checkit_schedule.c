@@ -0,0 +1,175 @@
+/*  CHECKIT  
+    A file checksummer and integrity tester 
+    Copyright (C) 2014 Dennis Katsonis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Budgeted scrubbing.
+ *
+ * A first pass over the files (SURVEY) only notes when each was last
+ * verified, from its fingerprint.  Those not verified within the
+ * interval are then checked stalest first, until the byte or time budget
+ * is spent.  Files never verified count as stalest of all.  Run often
+ * enough with a big enough budget, every file gets checked once per
+ * interval, wherever it is in the tree. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "checkit.h"
+#include "checkit_walk.h"
+#include "checkit_schedule.h"
+#include "checkit_progress.h"
+
+typedef struct {
+  char *path;
+  uint64_t size;
+  dev_t dev;
+  int64_t verified;	/* Nanoseconds, 0 if never, NO_CHECKSUM if no CRC */
+  size_t order;		/* Found in this order, to keep ties in tree order */
+} candidate;
+
+int scheduling = 0;
+static double byteLimit = 0;	/* 0 for none */
+static double deadline = 0;	/* Monotonic seconds, 0 for none */
+static int days = 0;
+static candidate *candidates = NULL;
+static size_t count = 0;
+static size_t size = 0;
+static size_t unsummed = 0;	/* Candidates without a checksum */
+static size_t due = 0;
+static size_t queued = 0;
+static int expired = 0;		/* Queued, but out of time when its turn came */
+
+static double monotonic(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void initSchedule(double byteBudget, double timeBudget, int interval)
+{ /* A budget of 0 means no limit of that kind.  With neither, each run
+   * gets through 1/interval of the data, enough to cover it all within
+   * the interval when run daily.  The time budget starts now. */
+  scheduling = 1;
+  byteLimit = byteBudget;
+  deadline = (timeBudget > 0) ? monotonic() + timeBudget : 0;
+  days = interval;
+}
+
+int addCandidate(char *path, const struct stat *statbuf, int64_t verified)
+{ /* A file found by the survey, with a checksum to verify or NO_CHECKSUM.
+   * Takes over path. */
+  candidate *c;
+
+  if (count == size)
+  {
+    size = size ? size * 2 : 1024;
+    if ((c = realloc(candidates, size * sizeof(candidate))) == NULL)
+      return ERROR_NO_MEM;
+    candidates = c;
+  }
+  c = &candidates[count];
+  c->path = path;
+  c->size = statbuf->st_size;
+  c->dev = statbuf->st_dev;
+  c->verified = verified;
+  c->order = count++;
+  if (verified == NO_CHECKSUM)
+    ++unsummed;
+  return SUCCESS;
+}
+
+static int stalest(const void *a, const void *b)
+{
+  const candidate *x = a;
+  const candidate *y = b;
+
+  if (x->verified != y->verified)
+    return (x->verified > y->verified) - (x->verified < y->verified);
+  return (x->order > y->order) - (x->order < y->order);
+}
+
+void runSchedule(int flags)
+{ /* Queue due files for checking, stalest first, until the budget is
+   * spent.  The last one queued may take it a little over.  Files without
+   * a checksum sort first and are always queued, to be reported as NO CRC;
+   * nothing is read for them, so they cost nothing. */
+  struct timespec now;
+  struct stat statbuf;
+  int64_t cutoff;
+  double total = 0;
+  double spent = 0;
+  size_t i;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  cutoff = (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec - days * NS_PER_DAY;
+  qsort(candidates, count, sizeof(candidate), stalest);
+  for (i = 0; i < count; i++)
+    if (candidates[i].verified != NO_CHECKSUM)
+      total += candidates[i].size;
+  if ((byteLimit == 0) && (deadline == 0))
+    byteLimit = total / days + 1;
+
+  for (i = 0; i < count; i++)
+  {
+    if (candidates[i].verified > cutoff)
+      break; /* Sorted, so the rest were all verified recently too */
+    statbuf.st_mode = S_IFREG;
+    statbuf.st_size = candidates[i].size;
+    statbuf.st_dev = candidates[i].dev;
+    if (candidates[i].verified == NO_CHECKSUM)
+    {
+      walkFile(candidates[i].path, &statbuf, flags, SUCCESS);
+      ++queued;
+      continue;
+    }
+    ++due;
+    if (((byteLimit > 0) && (spent >= byteLimit)) || scheduleExpired())
+      continue;
+    walkFile(candidates[i].path, &statbuf, flags, SUCCESS);
+    spent += candidates[i].size;
+    ++queued;
+  }
+  setProgressTotal(queued, spent);
+  for (i = 0; i < count; i++)
+    free(candidates[i].path);
+  free(candidates);
+  candidates = NULL;
+}
+
+int scheduleExpired(void)
+{ /* Is the time budget spent?  Files still queued then are skipped. */
+  return (deadline > 0) && (monotonic() >= deadline);
+}
+
+void scheduleSkipped(void)
+{
+  __atomic_add_fetch(&expired, 1, __ATOMIC_RELAXED);
+}
+
+void scheduleSummary(FILE *out)
+{
+  size_t checked = queued - unsummed - expired;
+
+  fprintf(out, "%zu of %zu file(s) with a checksum were due for checking (not verified in %d days), %zu checked this run.\n",
+	 due, count - unsummed, days, checked);
+  if (due > checked)
+    fprintf(out, "\nWARNING: **** %zu due file(s) left for the next run ****\n", due - checked);
+}
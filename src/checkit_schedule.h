@@ -0,0 +1,35 @@
+/*  CHECKIT  
+    A file checksummer and integrity tester 
+    Copyright (C) 2014 Dennis Katsonis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define NS_PER_DAY (86400LL * 1000000000LL)
+#define SCHEDULE_INTERVAL 30 /* Days, by default, to check every file within */
+#define MAX_INTERVAL 3650
+#define NO_CHECKSUM (-2) /* Surveyed as verified when there is no checksum */
+
+extern int scheduling;
+
+void initSchedule(double byteBudget, double timeBudget, int interval);
+int addCandidate(char *path, const struct stat *statbuf, int64_t verified);
+void runSchedule(int flags);
+int scheduleExpired(void);
+void scheduleSkipped(void);
+void scheduleSummary(FILE *out);
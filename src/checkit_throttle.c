@@ -0,0 +1,201 @@
+/*  CHECKIT  
+    A file checksummer and integrity tester 
+    Copyright (C) 2014 Dennis Katsonis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Limits on how hard we read.  A token bucket, shared by every thread,
+ * for bytes and for reads per second.  In adaptive mode the limits are
+ * cut back while /proc/pressure/io shows other tasks stalled on I/O,
+ * and eased off again once it settles. */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <time.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "checkit_throttle.h"
+
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+int throttling = 0;
+
+static pthread_mutex_t throttleLock = PTHREAD_MUTEX_INITIALIZER;
+static double byteLimit;	/* As asked for, 0 for none */
+static double opLimit;
+static double byteRate;		/* In force now */
+static double opRate;
+static double byteTime;		/* When the bytes handed out so far are paid for */
+static double opTime;
+
+static double pressureLimit;	/* Fraction of time stalled before we back off, 0 for never */
+static double lastSample;
+static unsigned long long lastStall;
+static double sampleBytes;	/* Read since the last sample */
+static double releaseRate;	/* With no byte limit of our own, when to lift the one we made */
+static long long ownStall;	/* Nanoseconds our own threads spent waiting for reads */
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int readPressure(unsigned long long *stall)
+{ /* Total microseconds that some task has been stalled on I/O. */
+  FILE *psi;
+  int found;
+
+  if ((psi = fopen("/proc/pressure/io", "r")) == NULL)
+    return -1;
+  found = fscanf(psi, "some avg10=%*f avg60=%*f avg300=%*f total=%llu", stall);
+  fclose(psi);
+  return (found == 1) ? 0 : -1;
+}
+
+int initThrottle(double bytesPerSec, double opsPerSec, double pressure)
+{ /* Returns non-zero if adaptive mode was asked for but pressure
+   * information isn't available. */
+  byteLimit = byteRate = bytesPerSec;
+  opLimit = opRate = opsPerSec;
+  pressureLimit = pressure;
+  byteTime = opTime = lastSample = now();
+  if ((pressureLimit > 0) && (readPressure(&lastStall) != 0))
+    pressureLimit = 0;
+  throttling = (byteRate > 0) || (opRate > 0) || (pressureLimit > 0);
+  return (pressure > 0) && (pressureLimit == 0);
+}
+
+int idleScheduling(void)
+{ /* Only use the disks and CPUs when nothing else wants them.  Threads
+   * started after this inherit it. */
+  struct sched_param param = { 0 };
+  int result = 0;
+
+  if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) == -1)
+    result = -1;
+  if (sched_setscheduler(0, SCHED_IDLE, &param) == -1)
+    result = -1;
+  return result;
+}
+
+static void adapt(double t)
+{ /* Called with the lock held, once per PSI_INTERVAL. */
+  unsigned long long stall;
+  double stalled;
+  double measured;
+  double own;
+
+  if (readPressure(&stall) != 0)
+    return;
+  /* Our own waits show up in the pressure figures too.  Take them out,
+   * so that we only back off for other tasks. */
+  own = __atomic_exchange_n(&ownStall, 0, __ATOMIC_RELAXED) / 1e9;
+  if (own > t - lastSample)
+    own = t - lastSample;
+  stalled = ((stall - lastStall) / 1e6 - own) / (t - lastSample);
+  if (own >= (t - lastSample) * PSI_SATURATED)
+    stalled = 1; /* We are waiting all the time, so can't see anyone else wait.  Leave some room. */
+  measured = sampleBytes / (t - lastSample);
+  lastStall = stall;
+  lastSample = t;
+  sampleBytes = 0;
+
+  if (stalled > pressureLimit)
+  { /* Back off quickly. */
+    if (byteRate == 0)
+    {
+      byteRate = (measured > MIN_BYTE_RATE) ? measured : MIN_BYTE_RATE;
+      releaseRate = byteRate * 2;
+    }
+    byteRate /= 2;
+    if (byteRate < MIN_BYTE_RATE)
+      byteRate = MIN_BYTE_RATE;
+    if (opRate > 0)
+      opRate = (opRate / 2 < MIN_OP_RATE) ? MIN_OP_RATE : opRate / 2;
+  }
+  else if (stalled < pressureLimit / 2)
+  { /* And recover slowly. */
+    if (byteRate > 0)
+    {
+      byteRate *= 1.25;
+      if ((byteLimit > 0) && (byteRate > byteLimit))
+	byteRate = byteLimit;
+      else if ((byteLimit == 0) && (byteRate > releaseRate))
+	byteRate = 0;
+    }
+    if (opRate > 0)
+      opRate = (opRate * 1.25 > opLimit) ? opLimit : opRate * 1.25;
+  }
+}
+
+double ioStart(void)
+{ /* Time a read, if adapting to I/O pressure.  Pass the result to ioEnd(). */
+  return (pressureLimit > 0) ? now() : 0;
+}
+
+void ioEnd(double start)
+{
+  if (start > 0)
+    __atomic_add_fetch(&ownStall, (long long)((now() - start) * 1e9), __ATOMIC_RELAXED);
+}
+
+void throttleWait(size_t bytes)
+{ /* Take bytes, and one read, from the buckets, sleeping until they
+   * have been paid for. */
+  struct timespec ts;
+  double t;
+  double wait = 0;
+
+  pthread_mutex_lock(&throttleLock);
+  t = now();
+  if ((pressureLimit > 0) && (t - lastSample >= PSI_INTERVAL))
+    adapt(t);
+  sampleBytes += bytes;
+
+  if (byteRate > 0)
+  {
+    if (byteTime < t - THROTTLE_BURST)
+      byteTime = t - THROTTLE_BURST;
+    byteTime += bytes / byteRate;
+    wait = byteTime - t;
+  }
+  if (opRate > 0)
+  {
+    if (opTime < t - THROTTLE_BURST)
+      opTime = t - THROTTLE_BURST;
+    opTime += 1 / opRate;
+    if (opTime - t > wait)
+      wait = opTime - t;
+  }
+  pthread_mutex_unlock(&throttleLock);
+
+  if (wait > 0)
+  {
+    ts.tv_sec = (time_t)wait;
+    ts.tv_nsec = (long)((wait - ts.tv_sec) * 1e9);
+    while ((nanosleep(&ts, &ts) == -1) && (errno == EINTR))
+      ;
+  }
+}
@@ -0,0 +1,36 @@
+/*  CHECKIT  
+    A file checksummer and integrity tester 
+    Copyright (C) 2014 Dennis Katsonis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stddef.h>
+
+#define THROTTLE_BURST 0.1	/* Seconds of unused allowance that can be saved up */
+#define PSI_INTERVAL 1.0	/* Seconds between looks at /proc/pressure/io */
+#define PSI_SATURATED 0.9	/* Fraction of the time our own reads can wait before we can't tell */
+#define MIN_BYTE_RATE (1024.0 * 1024.0) /* Adaptive mode never goes slower than this */
+#define MIN_OP_RATE 10.0
+
+extern int throttling;
+
+int initThrottle(double bytesPerSec, double opsPerSec, double pressureLimit);
+int idleScheduling(void);
+void throttleWait(size_t bytes);
+double ioStart(void);
+void ioEnd(double start);
+
+/* Call before each read.  Does nothing unless a limit has been set. */
+#define throttleIO(bytes)	do { if (throttling) throttleWait(bytes); } while (0)
@@ -0,0 +1,720 @@
+/*  CHECKIT  
+    A file checksummer and integrity tester 
+    Copyright (C) 2014 Dennis Katsonis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Parallel directory traversal with results printed in traversal order.
+ *
+ * Each directory is scanned by a pool task, using a descriptor for the
+ * directory and openat() relative to it, so no thread changes the
+ * working directory and no full path is resolved more than once.
+ * Subdirectories become new tasks, which idle workers steal.  Files
+ * become file tasks.
+ *
+ * The type of each entry comes from d_type where the filesystem fills it
+ * in, so most entries cost no metadata call at all while scanning.  Only
+ * symlinks and DT_UNKNOWN entries are looked up, asking statx() for the
+ * type alone.  Files are left for the worker to inspect through their
+ * own descriptor.
+ *
+ * Files are handed to the workers in batches sorted by inode number, or
+ * with EXTENTORDER by where their data starts on disk (FS_IOC_FIEMAP),
+ * so a disk that has to seek sees a mostly ascending stream.
+ *
+ * Everything found is recorded in a tree mirroring the directories.  The
+ * thread which called walkFile()/walkDirectory() (the emitter) walks that
+ * tree depth first, in readdir order, printing each result once it is
+ * ready.  That order does not depend on how the work was shared out.
+ * The command line arguments are the entries of a root directory which
+ * has the current directory as its descriptor. */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+#include "checkit.h"
+#include "checkit_walk.h"
+#include "checkit_fs.h"
+#include "checkit_journal.h"
+#include "checkit_output.h"
+
+#define ENTRY_BATCH 128
+#define SORT_BATCH 1024 /* Files sorted into disk order at a time */
+#define EMIT_BACKLOG_PER_THREAD 4096 /* Unprinted files before the emitter stops queueing */
+
+typedef struct {
+  fileJob *job;
+  struct walkDir *sub;
+} walkEntry;
+
+typedef struct walkDir {
+  poolTask task;	/* Must be first */
+  struct walkDir *parent;
+  char *name;		/* Relative to the parent's descriptor */
+  char *path;		/* Prefix for entries, ends in '/' unless empty */
+  int fd;
+  int refs;		/* Users of fd: our scan, unopened subdirectories and files */
+  int lane;		/* Worker lane for its files (the disk they are on) */
+  int flags;
+  walkEntry *entries;	/* Published entries, guarded by walkLock */
+  int count;
+  int size;
+  int enumerated;
+  long long skipped;	/* Entries finished by the run being resumed */
+  const char *skippedLast; /* The last of them */
+} walkDir;
+
+enum emitWaits
+{
+  EMIT_NOWAIT,
+  EMIT_BACKLOG,	/* Until few enough results are waiting */
+  EMIT_ALL	/* Until everything queued so far is printed */
+};
+
+static pthread_mutex_t walkLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t walkCond = PTHREAD_COND_INITIALIZER;
+static int emitterWaiting = 0;
+static int outstanding = 0;	/* Files found but not yet printed */
+static int maxOutstanding;
+
+static walkDir root;
+static struct {
+  walkDir *dir;
+  int index;
+  char *last;		/* Name of the last entry printed, if journaling */
+  size_t lastSize;
+} *stack;			/* Emitter's position in the tree */
+static int depth = 0;
+static int stackSize = 0;
+
+static void (*doWork)(fileJob *job);
+static void (*doEmit)(fileJob *job);
+
+static void *walkAlloc(size_t size)
+{
+  void *ptr = malloc(size);
+
+  if (ptr == NULL)
+  {
+    perror("Could not allocate memory :");
+    exit(ERROR_NO_MEM);
+  }
+  return ptr;
+}
+
+static void releaseDir(walkDir *dir)
+{
+  if (dir == &root)
+    return;
+  if (__atomic_sub_fetch(&dir->refs, 1, __ATOMIC_ACQ_REL) == 0)
+  {
+    close(dir->fd);
+    dir->fd = -1;
+  }
+}
+
+static void wakeEmitter(void)
+{ /* Called with walkLock held. */
+  if (emitterWaiting)
+    pthread_cond_signal(&walkCond);
+}
+
+static void publish(walkDir *dir, walkEntry *batch, int n, int last)
+{ /* Make scanned entries visible to the emitter. */
+  pthread_mutex_lock(&walkLock);
+  if (n > 0)
+  {
+    if (dir->count + n > dir->size)
+    {
+      dir->size = (dir->count + n) * 2;
+      dir->entries = realloc(dir->entries, dir->size * sizeof(walkEntry));
+      if (dir->entries == NULL)
+      {
+	perror("Could not allocate memory :");
+	exit(ERROR_NO_MEM);
+      }
+    }
+    memcpy(dir->entries + dir->count, batch, n * sizeof(walkEntry));
+    dir->count += n;
+  }
+  if (last)
+    dir->enumerated = 1;
+  wakeEmitter();
+  pthread_mutex_unlock(&walkLock);
+}
+
+static void runFileTask(poolTask *task)
+{
+  fileJob *job = (fileJob *)task;
+
+  job->out = open_memstream(&job->outBuf, &job->outLen);
+  if (job->out == NULL)
+  {
+    perror("Could not allocate memory :");
+    exit(ERROR_NO_MEM);
+  }
+  doWork(job);
+  fclose(job->out);
+  job->out = NULL;
+  releaseDir(job->dir);
+
+  pthread_mutex_lock(&walkLock);
+  job->done = 1;
+  wakeEmitter();
+  pthread_mutex_unlock(&walkLock);
+}
+
+static fileJob *newJob(walkDir *dir, const char *name, const struct stat *statbuf, int flags, int status)
+{
+  fileJob *job = walkAlloc(sizeof(fileJob));
+  size_t prefix = strlen(dir->path);
+
+  job->path = walkAlloc(prefix + strlen(name) + 1);
+  memcpy(job->path, dir->path, prefix);
+  strcpy(job->path + prefix, name);
+  job->name = job->path + prefix;
+  job->dir = dir;
+  job->flags = flags;
+  job->inDir = (dir != &root);
+  job->status = status;
+  if (statbuf != NULL)
+    job->statbuf = *statbuf;
+  else
+    memset(&job->statbuf, 0, sizeof(job->statbuf));
+  job->physical = 0;
+  job->verdict = 0;
+  job->verified = -1;
+  job->outBuf = NULL;
+  job->outLen = 0;
+  job->done = 0;
+  job->task.run = runFileTask;
+  if (dir != &root)
+    __atomic_add_fetch(&dir->refs, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&outstanding, 1, __ATOMIC_RELAXED);
+  return job;
+}
+
+static void scanDir(poolTask *task);
+
+static walkDir *newDir(walkDir *parent, const char *name, int flags)
+{
+  walkDir *dir = walkAlloc(sizeof(walkDir));
+  size_t len = strlen(parent->path) + strlen(name);
+
+  dir->parent = parent;
+  dir->name = walkAlloc(strlen(name) + 1);
+  strcpy(dir->name, name);
+  dir->path = walkAlloc(len + 2);
+  sprintf(dir->path, "%s%s", parent->path, name);
+  if ((len > 0) && (dir->path[len - 1] != '/'))
+    strcat(dir->path, "/");
+  dir->fd = -1;
+  dir->refs = 1;
+  dir->lane = 0;
+  dir->flags = flags;
+  dir->entries = NULL;
+  dir->count = dir->size = 0;
+  dir->enumerated = 0;
+  dir->skipped = 0;
+  dir->skippedLast = NULL;
+  dir->task.run = scanDir;
+  if (parent != &root)
+    __atomic_add_fetch(&parent->refs, 1, __ATOMIC_RELAXED);
+  return dir;
+}
+
+int statAt(int dirfd, const char *name, int atflags, unsigned int mask, struct stat *statbuf)
+{ /* fstatat(), but only asking for the statx() fields in mask (and
+   * without forcing a sync with the server if AT_STATX_DONT_SYNC is in
+   * atflags).  Fields not asked for may be left as zero. */
+#ifdef STATX_TYPE
+  static int noStatx = 0;
+  struct statx stx;
+
+  if (!noStatx)
+  {
+    if (statx(dirfd, name, atflags, mask, &stx) == 0)
+    {
+      memset(statbuf, 0, sizeof(*statbuf));
+      statbuf->st_mode = stx.stx_mode;
+      statbuf->st_ino = stx.stx_ino;
+      statbuf->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+      statbuf->st_nlink = stx.stx_nlink;
+      statbuf->st_size = stx.stx_size;
+      statbuf->st_blksize = stx.stx_blksize;
+      statbuf->st_blocks = stx.stx_blocks;
+      statbuf->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+      statbuf->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+      statbuf->st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+      statbuf->st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+      return 0;
+    }
+    if (errno != ENOSYS)
+      return -1;
+    noStatx = 1; /* Old kernel. */
+  }
+#endif
+  return fstatat(dirfd, name, statbuf, atflags & (AT_SYMLINK_NOFOLLOW | AT_EMPTY_PATH));
+}
+
+static int entryType(walkDir *dir, const struct dirent *entry, struct stat *statbuf)
+{ /* Work out what a directory entry is.  Symlinks are followed. */
+  if ((entry->d_type != DT_UNKNOWN) && (entry->d_type != DT_LNK))
+  {
+    memset(statbuf, 0, sizeof(*statbuf));
+    statbuf->st_mode = DTTOIF(entry->d_type);
+    statbuf->st_ino = entry->d_ino;
+    return 0;
+  }
+#ifdef STATX_TYPE
+  return statAt(dir->fd, entry->d_name, AT_STATX_DONT_SYNC, STATX_TYPE, statbuf);
+#else
+  return statAt(dir->fd, entry->d_name, 0, 0, statbuf);
+#endif
+}
+
+static uint64_t firstExtent(int dirfd, const char *name)
+{ /* Where on disk a file's data starts, or 0 if we can't tell. */
+  struct {
+    struct fiemap map;
+    struct fiemap_extent extent;
+  } fm;
+  uint64_t physical = 0;
+  int fd;
+
+  if ((fd = openat(dirfd, name, O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC)) == -1)
+    return 0;
+  memset(&fm, 0, sizeof(fm));
+  fm.map.fm_length = FIEMAP_MAX_OFFSET;
+  fm.map.fm_extent_count = 1;
+  if ((ioctl(fd, FS_IOC_FIEMAP, &fm.map) == 0) && (fm.map.fm_mapped_extents == 1) &&
+      !(fm.extent.fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE)))
+    physical = fm.extent.fe_physical;
+  close(fd);
+  return physical;
+}
+
+static int diskOrder(const void *a, const void *b)
+{ /* By first extent where both are known, otherwise by inode. */
+  const fileJob *x = *(fileJob * const *)a;
+  const fileJob *y = *(fileJob * const *)b;
+
+  if (x->physical && y->physical)
+    return (x->physical > y->physical) - (x->physical < y->physical);
+  if (x->physical || y->physical)
+    return x->physical ? -1 : 1;
+  return (x->statbuf.st_ino > y->statbuf.st_ino) - (x->statbuf.st_ino < y->statbuf.st_ino);
+}
+
+static void queueFiles(walkDir *dir, fileJob **files, int n)
+{
+  int i;
+
+  qsort(files, n, sizeof(fileJob *), diskOrder);
+  for (i = 0; i < n; i++)
+    pushFileTask(&files[i]->task, dir->lane);
+}
+
+static long long skipFinished(walkDir *dir, DIR *dp)
+{ /* On resuming, read past the entries of dir that were finished before.
+   * If it doesn't look as it did then, start again from its beginning. */
+  const char *last;
+  long long skip = resumePoint(dir->path, &last);
+  long long n = 0;
+  struct dirent *entry = NULL;
+
+  while ((n < skip) && ((entry = readdir(dp)) != NULL))
+  {
+    if (strcmp(".", entry->d_name) != 0 && strcmp("..", entry->d_name) != 0)
+      ++n;
+  }
+  if ((n > 0) && ((n < skip) || (strcmp(entry->d_name, last) != 0)))
+  {
+    rewinddir(dp);
+    return 0;
+  }
+  if (n > 0)
+  {
+    pthread_mutex_lock(&walkLock);
+    dir->skipped = n;
+    dir->skippedLast = last;
+    pthread_mutex_unlock(&walkLock);
+  }
+  return n;
+}
+
+static void scanDir(poolTask *task)
+{ /* Scan a directory, queueing its files and subdirectories. */
+  walkDir *dir = (walkDir *)task;
+  walkEntry batch[ENTRY_BATCH];
+  walkDir **subdirs = NULL;
+  int nsub = 0, subsize = 0;
+  fileJob *files[SORT_BATCH];
+  int nfiles = 0;
+  int n = 0;
+  int dfd;
+  DIR *dp = NULL;
+  struct dirent *entry;
+  struct stat statbuf;
+  fileJob *job;
+
+  dir->fd = openat(dir->parent->fd, dir->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  releaseDir(dir->parent);
+  if ((dir->fd == -1) || ((dfd = dup(dir->fd)) == -1) || ((dp = fdopendir(dfd)) == NULL))
+  { /* Report it in place of the directory's contents. */
+    if (strlen(dir->path) > 1)
+      dir->path[strlen(dir->path) - 1] = 0;
+    job = newJob(dir, "", NULL, dir->flags, ERROR_OPEN_DIR);
+    job->inDir = 0;
+    batch[0].job = job;
+    batch[0].sub = NULL;
+    pushFileTask(&job->task, 0);
+    releaseDir(dir);
+    publish(dir, batch, 1, 1); /* The emitter may free dir once it has this */
+    return;
+  }
+  /* Lanes only matter if there is more than one worker. */
+  if ((poolWorkers() > 0) && (fstat(dir->fd, &statbuf) == 0))
+    dir->lane = deviceLane(statbuf.st_dev);
+  if (journaling)
+    skipFinished(dir, dp);
+
+  while ((entry = readdir(dp)) != NULL)
+  {
+    if (strcmp(".", entry->d_name) == 0 || strcmp("..", entry->d_name) == 0)
+      continue;
+
+    if (entryType(dir, entry, &statbuf) == -1)
+    {
+      if (errno == ENOENT)
+	continue; /* Deleted since readdir() */
+      batch[n].job = newJob(dir, entry->d_name, NULL, dir->flags, ERROR_OPEN_FILE);
+      batch[n].job->statbuf.st_ino = entry->d_ino;
+      batch[n].sub = NULL;
+      files[nfiles++] = batch[n].job;
+    }
+    else if (S_ISDIR(statbuf.st_mode))
+    {
+      batch[n].job = NULL;
+      batch[n].sub = newDir(dir, entry->d_name, dir->flags);
+      if (nsub == subsize)
+      {
+	subsize = subsize ? subsize * 2 : 16;
+	subdirs = realloc(subdirs, subsize * sizeof(walkDir *));
+	if (subdirs == NULL)
+	{
+	  perror("Could not allocate memory :");
+	  exit(ERROR_NO_MEM);
+	}
+      }
+      subdirs[nsub++] = batch[n].sub;
+    }
+    else
+    {
+      batch[n].job = newJob(dir, entry->d_name, &statbuf, dir->flags, SUCCESS);
+      batch[n].sub = NULL;
+      if ((dir->flags & EXTENTORDER) && S_ISREG(statbuf.st_mode))
+	batch[n].job->physical = firstExtent(dir->fd, entry->d_name);
+      files[nfiles++] = batch[n].job;
+    }
+    if (++n == ENTRY_BATCH)
+    {
+      publish(dir, batch, n, 0);
+      n = 0;
+    }
+    if (nfiles == SORT_BATCH)
+    {
+      queueFiles(dir, files, nfiles);
+      nfiles = 0;
+    }
+  }
+  closedir(dp);
+  queueFiles(dir, files, nfiles);
+
+  /* Pushed last first, so this worker carries on with the first
+   * subdirectory, which is also the one the emitter wants next. */
+  while (nsub > 0)
+    pushDirTask(&subdirs[--nsub]->task);
+  free(subdirs);
+  releaseDir(dir);
+  /* Last, as once everything in it is printed the emitter frees dir. */
+  publish(dir, batch, n, 1);
+}
+
+static void pushStack(walkDir *dir)
+{
+  if (depth == stackSize)
+  {
+    stackSize = stackSize ? stackSize * 2 : 64;
+    stack = realloc(stack, stackSize * sizeof(*stack));
+    if (stack == NULL)
+    {
+      perror("Could not allocate memory :");
+      exit(ERROR_NO_MEM);
+    }
+    memset(stack + depth, 0, (stackSize - depth) * sizeof(*stack));
+  }
+  stack[depth].dir = dir;
+  stack[depth].index = 0;
+  ++depth;
+}
+
+static void noteDone(int level, const char *name)
+{ /* Remember the last entry printed at a level, for checkpoints. */
+  size_t len = strlen(name) + 1;
+
+  if (len > stack[level].lastSize)
+  {
+    stack[level].lastSize = len * 2;
+    stack[level].last = realloc(stack[level].last, stack[level].lastSize);
+    if (stack[level].last == NULL)
+    {
+      perror("Could not allocate memory :");
+      exit(ERROR_NO_MEM);
+    }
+  }
+  memcpy(stack[level].last, name, len);
+}
+
+static void checkpoint(void)
+{ /* Journal how far printing has got.  At every level but the deepest,
+   * the entry last stepped into is still in progress.  Called by the
+   * emitter with walkLock held. */
+  journalLevel *level = walkAlloc(depth * sizeof(journalLevel));
+  long long done;
+  int i, n = 0;
+
+  for (i = 0; i < depth; i++)
+  {
+    done = stack[i].index - (i < depth - 1);
+    level[n].path = stack[i].dir->path;
+    level[n].done = stack[i].dir->skipped + done;
+    level[n].last = done ? stack[i].last : stack[i].dir->skippedLast;
+    if (level[n].done > 0)
+      ++n;
+  }
+  /* Only the emitter frees directories, so their paths stay valid. */
+  pthread_mutex_unlock(&walkLock);
+  writeJournal(level, n);
+  free(level);
+  pthread_mutex_lock(&walkLock);
+}
+
+static void emitJob(fileJob *job)
+{
+  if (job->outBuf != NULL)
+  {
+    fwrite(job->outBuf, 1, job->outLen, stdout);
+    free(job->outBuf);
+  }
+  __atomic_sub_fetch(&outstanding, 1, __ATOMIC_RELAXED);
+  doEmit(job);
+}
+
+static void freeDir(walkDir *dir)
+{
+  free(dir->entries);
+  if (dir == &root)
+  {
+    dir->entries = NULL;
+    return;
+  }
+  free(dir->name);
+  free(dir->path);
+  free(dir);
+}
+
+static void emitReady(int wait)
+{ /* Print every result that is ready, in order.  Depending on wait, then
+   * block until more results are printed. */
+  walkDir *dir;
+  walkEntry entry;
+
+  pthread_mutex_lock(&walkLock);
+  while (depth > 0)
+  {
+    dir = stack[depth - 1].dir;
+    if (stack[depth - 1].index < dir->count)
+    {
+      entry = dir->entries[stack[depth - 1].index];
+      if (entry.sub != NULL)
+      {
+	++stack[depth - 1].index;
+	pushStack(entry.sub);
+	continue;
+      }
+      if (entry.job->done)
+      {
+	++stack[depth - 1].index;
+	if (journaling)
+	  noteDone(depth - 1, entry.job->name);
+	pthread_mutex_unlock(&walkLock);
+	emitJob(entry.job);
+	pthread_mutex_lock(&walkLock);
+	if (journaling && journalDue())
+	  checkpoint();
+	continue;
+      }
+    }
+    else if (dir->enumerated)
+    {
+      --depth;
+      if (journaling && (depth > 0))
+	noteDone(depth - 1, dir->name);
+      freeDir(dir);
+      continue;
+    }
+
+    /* The next result is not ready yet. */
+    if ((wait == EMIT_NOWAIT) ||
+	((wait == EMIT_BACKLOG) && (__atomic_load_n(&outstanding, __ATOMIC_RELAXED) <= maxOutstanding)) ||
+	((wait == EMIT_ALL) && (depth == 1) && (stack[0].index == root.count)))
+      break;
+
+    if (poolWorkers() > 0)
+    {
+      emitterWaiting = 1;
+      pthread_cond_wait(&walkCond, &walkLock);
+      emitterWaiting = 0;
+    }
+    else
+    { /* No workers, so do the work ourselves. */
+      pthread_mutex_unlock(&walkLock);
+      wait = runPendingTask() ? wait : EMIT_NOWAIT;
+      pthread_mutex_lock(&walkLock);
+    }
+  }
+  pthread_mutex_unlock(&walkLock);
+}
+
+int initWalk(int threads, void (*work)(fileJob *job), void (*emit)(fileJob *job))
+{
+  struct rlimit limit;
+
+  doWork = work;
+  doEmit = emit;
+  maxOutstanding = EMIT_BACKLOG_PER_THREAD * threads;
+
+  /* Every directory with files still queued keeps a descriptor open. */
+  if ((getrlimit(RLIMIT_NOFILE, &limit) == 0) && (limit.rlim_cur < limit.rlim_max))
+  {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  root.parent = NULL;
+  root.name = "";
+  root.path = "";
+  root.fd = AT_FDCWD;
+  root.entries = NULL;
+  root.count = root.size = 0;
+  root.enumerated = 0;
+  root.skipped = 0;
+  root.skippedLast = NULL;
+  pushStack(&root);
+
+  return initPool(threads);
+}
+
+static void addRootEntry(walkEntry *entry)
+{
+  pthread_mutex_lock(&walkLock);
+  if (!journaling && (stack[0].index == root.count))
+  { /* Everything named so far is printed, so start the list again.
+     * Keeps it small when watching, with files named one at a time. */
+    stack[0].index = 0;
+    root.count = 0;
+  }
+  pthread_mutex_unlock(&walkLock);
+  publish(&root, entry, 1, 0);
+  /* With no worker threads, finish each argument before the next, as
+   * nothing else would be running meanwhile anyway. */
+  emitReady(poolWorkers() ? EMIT_BACKLOG : EMIT_ALL);
+}
+
+int walkResumed(const char *path)
+{ /* Whether a file or directory named on the command line was finished
+   * by the run being resumed, so can be passed over. */
+  static long long skip = -1;
+  static const char *last;
+
+  if (!journaling)
+    return 0;
+  if (skip == -1)
+    skip = resumePoint("", &last);
+  if (root.skipped >= skip)
+    return 0;
+  if ((++root.skipped == skip) && (strcmp(path, last) != 0))
+    fprintf(statusStream(), "The files named are not those the journal was made with.\n");
+  root.skippedLast = last;
+  return 1;
+}
+
+void walkFile(const char *path, const struct stat *statbuf, int flags, int status)
+{ /* Queue a file named on the command line. */
+  walkEntry entry;
+
+  entry.sub = NULL;
+  entry.job = newJob(&root, path, statbuf, flags, status);
+  pushFileTask(&entry.job->task, ((statbuf != NULL) && (poolWorkers() > 0)) ? deviceLane(statbuf->st_dev) : 0);
+  addRootEntry(&entry);
+}
+
+void walkDirectory(const char *path, int flags)
+{ /* Queue a directory named on the command line. */
+  walkEntry entry;
+
+  entry.job = NULL;
+  entry.sub = newDir(&root, path, flags);
+  pushDirTask(&entry.sub->task);
+  addRootEntry(&entry);
+}
+
+int jobDirFd(const fileJob *job)
+{ /* Descriptor job->name is relative to.  Valid until the job is done. */
+  return job->dir->fd;
+}
+
+void drainWalk(void)
+{ /* Wait until everything queued so far has been processed and printed.
+   * More can be queued afterwards. */
+  emitReady(EMIT_ALL);
+  fflush(stdout);
+}
+
+void finishWalk(void)
+{
+  pthread_mutex_lock(&walkLock);
+  root.enumerated = 1;
+  pthread_mutex_unlock(&walkLock);
+  emitReady(EMIT_ALL);
+  fflush(stdout);
+  finishPool();
+}
@@ -0,0 +1,52 @@
+/*  CHECKIT  
+    A file checksummer and integrity tester 
+    Copyright (C) 2014 Dennis Katsonis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "checkit_pool.h"
+
+struct walkDir;
+
+typedef struct fileJob {
+  poolTask task;	/* Must be first */
+  struct walkDir *dir;	/* Directory the file was found in */
+  char *path;		/* Path to print */
+  const char *name;	/* Path relative to the directory (see jobDirFd()) */
+  int flags;
+  int inDir;		/* Found while recursing a directory */
+  int status;		/* Error found before the file was processed */
+  struct stat statbuf;	/* Only st_mode and st_ino are known for files found recursing */
+  uint64_t physical;	/* Where the data starts on disk, if EXTENTORDER, 0 if not known */
+  int verdict;		/* Set by the worker, looked at when emitted */
+  int64_t verified;	/* Set by the worker when surveying, -1 if nothing to verify, NO_CHECKSUM if no CRC */
+  FILE *out;		/* Output for this file, replayed in order */
+  char *outBuf;
+  size_t outLen;
+  int done;
+} fileJob;
+
+int initWalk(int threads, void (*work)(fileJob *job), void (*emit)(fileJob *job));
+int walkResumed(const char *path);
+void walkFile(const char *path, const struct stat *statbuf, int flags, int status);
+void walkDirectory(const char *path, int flags);
+int jobDirFd(const fileJob *job);
+int statAt(int dirfd, const char *name, int atflags, unsigned int mask, struct stat *statbuf);
+void drainWalk(void);
+void finishWalk(void);
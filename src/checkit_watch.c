@@ -0,0 +1,402 @@
+/*  CHECKIT  
+    A file checksummer and integrity tester 
+    Copyright (C) 2014 Dennis Katsonis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Watching for files being written, and stamping them once they settle.
+ *
+ * fanotify is used where we are allowed (it needs CAP_SYS_ADMIN), with
+ * a mark on each mount that is watched, so nothing has to be done for
+ * new directories.  Otherwise inotify, with a watch on every directory.
+ * A file is stamped once WATCH_DELAY seconds go by without it being
+ * written again, so something written in many pieces is only read once,
+ * at the end. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+
+#include "checkit.h"
+#include "checkit_walk.h"
+#include "checkit_watch.h"
+#include "checkit_output.h"
+
+typedef struct pendingFile {
+  struct pendingFile *next;	/* In the same bucket */
+  struct pendingFile *older;	/* Every pending file, oldest first */
+  struct pendingFile *newer;
+  time_t first;		/* First write since it was last stamped */
+  time_t last;		/* Latest write */
+  char path[];
+} pendingFile;
+
+typedef struct {
+  char *path;		/* Real path, for fanotify */
+  size_t len;
+  int isDir;
+} watchRoot;
+
+static volatile sig_atomic_t stopWatching = 0;
+static pendingFile *bucket[WATCH_BUCKETS];
+static pendingFile *oldest = NULL;
+static pendingFile *newest = NULL;
+static int watchFlags;
+
+static watchRoot *roots = NULL;
+static int rootCount = 0;
+static char **wdPath = NULL;	/* Directory (or file) of each inotify watch */
+static int wdSize = 0;
+
+static void stopWatch(int sig)
+{
+  (void)sig;
+  stopWatching = 1;
+}
+
+static time_t monotonicSeconds(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec;
+}
+
+static unsigned int pathHash(const char *path)
+{
+  unsigned int hash = 5381;
+
+  while (*path)
+    hash = hash * 33 + (unsigned char)*path++;
+  return hash % WATCH_BUCKETS;
+}
+
+static void unlinkPending(pendingFile *file)
+{ /* Take file off the list in write order. */
+  if (file->older != NULL)
+    file->older->newer = file->newer;
+  else
+    oldest = file->newer;
+  if (file->newer != NULL)
+    file->newer->older = file->older;
+  else
+    newest = file->older;
+}
+
+static void written(const char *path)
+{ /* A file was closed after being written.  Put off stamping it. */
+  const char *base = strrchr(path, '/');
+  unsigned int hash = pathHash(path);
+  pendingFile *file;
+  time_t now = monotonicSeconds();
+
+  if ((base ? base[1] : path[0]) == '.')
+    return; /* Hidden, including our own .crc64 files */
+  for (file = bucket[hash]; file != NULL; file = file->next)
+    if (strcmp(file->path, path) == 0)
+      break;
+  if (file == NULL)
+  {
+    if ((file = malloc(sizeof(pendingFile) + strlen(path) + 1)) == NULL)
+    {
+      perror("Could not allocate memory :");
+      exit(ERROR_NO_MEM);
+    }
+    strcpy(file->path, path);
+    file->first = now;
+    file->next = bucket[hash];
+    bucket[hash] = file;
+  }
+  else
+    unlinkPending(file);
+  file->last = now;
+  file->newer = NULL;
+  file->older = newest;
+  if (newest != NULL)
+    newest->newer = file;
+  else
+    oldest = file;
+  newest = file;
+}
+
+static int stampDue(int (*stamp)(char *path, int flags), int all)
+{ /* Stamp every file that has settled, or been pending too long (or all
+   * of them).  Returns how many were stamped. */
+  pendingFile *file, *newer, **link;
+  time_t now = monotonicSeconds();
+  int stamped = 0;
+
+  for (file = oldest; file != NULL; file = newer)
+  {
+    newer = file->newer;
+    if (!all && (now - file->last < WATCH_DELAY) && (now - file->first < WATCH_MAX_DELAY))
+      continue;
+    unlinkPending(file);
+    for (link = &bucket[pathHash(file->path)]; *link != file; link = &(*link)->next)
+      ;
+    *link = file->next;
+    stamp(file->path, watchFlags & ~RECURSE);
+    free(file);
+    ++stamped;
+  }
+  return stamped;
+}
+
+static int watched(const char *path)
+{ /* Whether a file fanotify told us about is one we were asked to watch. */
+  int i;
+
+  for (i = 0; i < rootCount; i++)
+  {
+    if (!roots[i].isDir)
+    {
+      if (strcmp(path, roots[i].path) == 0)
+	return 1;
+    }
+    else if ((strncmp(path, roots[i].path, roots[i].len) == 0) && (path[roots[i].len] == '/') &&
+	     ((watchFlags & RECURSE) || (strchr(path + roots[i].len + 1, '/') == NULL)))
+      return 1;
+  }
+  return 0;
+}
+
+static int initFanotify(char **paths, int count)
+{ /* Mark the mounts the files are on.  Returns the descriptor to read
+   * events from, or -1 if fanotify can't be used. */
+  struct stat statbuf;
+  char *real;
+  int fd;
+  int i;
+
+  fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return -1;
+  roots = calloc(count, sizeof(watchRoot));
+  if (roots == NULL)
+  {
+    perror("Could not allocate memory :");
+    exit(ERROR_NO_MEM);
+  }
+  for (i = 0; i < count; i++)
+  {
+    if (((real = realpath(paths[i], NULL)) == NULL) || (stat(real, &statbuf) == -1) ||
+	(fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_MOUNT, FAN_CLOSE_WRITE, AT_FDCWD, real) == -1))
+    {
+      fprintf(statusStream(), "Can not watch %s : %s\n", paths[i], strerror(errno));
+      free(real);
+      continue;
+    }
+    roots[rootCount].path = real;
+    /* "/" matches everything below it with no more slash */
+    roots[rootCount].len = (strcmp(real, "/") == 0) ? 0 : strlen(real);
+    roots[rootCount++].isDir = S_ISDIR(statbuf.st_mode);
+  }
+  return fd;
+}
+
+static void fanotifyEvents(int fd)
+{
+  char buf[64 * 1024] __attribute__ ((aligned(__alignof__(struct fanotify_event_metadata))));
+  char link[64];
+  char path[PATH_MAX];
+  struct fanotify_event_metadata *event;
+  ssize_t len;
+  ssize_t n;
+
+  while ((len = read(fd, buf, sizeof(buf))) > 0)
+  {
+    for (event = (struct fanotify_event_metadata *)buf; FAN_EVENT_OK(event, len);
+	 event = FAN_EVENT_NEXT(event, len))
+    {
+      if (event->mask & FAN_Q_OVERFLOW)
+	fprintf(statusStream(), "Too many files written at once, some were missed.  Store their checksums with -s -r.\n");
+      if (event->fd < 0)
+	continue;
+      snprintf(link, sizeof(link), "/proc/self/fd/%d", event->fd);
+      if ((n = readlink(link, path, sizeof(path) - 1)) > 0)
+      {
+	path[n] = 0;
+	if (watched(path))
+	  written(path);
+      }
+      close(event->fd);
+    }
+  }
+}
+
+static void addWatches(int fd, const char *path, int top, int created)
+{ /* Watch a directory, and with RECURSE the ones in it.  A file named
+   * on the command line (top) is watched on its own.  A directory
+   * created or moved here while watching (created) may already hold
+   * files, written before its watch was added, so those are stamped. */
+  DIR *dp;
+  struct dirent *entry;
+  struct stat statbuf;
+  char *sub;
+  int isDir;
+  int wd;
+
+  wd = inotify_add_watch(fd, path, IN_CLOSE_WRITE | IN_CREATE | IN_MOVED_TO);
+  if (wd == -1)
+  {
+    if ((errno == ENOSPC) || top)
+      fprintf(statusStream(), "Can not watch %s : %s\n", path, (errno == ENOSPC) ?
+	     "Too many watches (see /proc/sys/fs/inotify/max_user_watches)" : strerror(errno));
+    return;
+  }
+  if (wd >= wdSize)
+  {
+    wdPath = realloc(wdPath, (wd + 1) * 2 * sizeof(char *));
+    if (wdPath == NULL)
+    {
+      perror("Could not allocate memory :");
+      exit(ERROR_NO_MEM);
+    }
+    memset(wdPath + wdSize, 0, ((wd + 1) * 2 - wdSize) * sizeof(char *));
+    wdSize = (wd + 1) * 2;
+  }
+  if (wdPath[wd] == NULL)
+    wdPath[wd] = strdup(path);
+
+  if (!(watchFlags & RECURSE) || ((dp = opendir(path)) == NULL))
+    return;
+  while ((entry = readdir(dp)) != NULL)
+  {
+    if ((strcmp(entry->d_name, ".") == 0) || (strcmp(entry->d_name, "..") == 0))
+      continue;
+    if (entry->d_type == DT_UNKNOWN)
+    { /* Not every filesystem fills in d_type */
+      if (fstatat(dirfd(dp), entry->d_name, &statbuf, AT_SYMLINK_NOFOLLOW) == -1)
+	continue;
+      isDir = S_ISDIR(statbuf.st_mode);
+      if (!isDir && !S_ISREG(statbuf.st_mode))
+	continue;
+    }
+    else if ((entry->d_type == DT_DIR) || (entry->d_type == DT_REG))
+      isDir = (entry->d_type == DT_DIR);
+    else
+      continue;
+    if (!isDir && !created)
+      continue;
+    if ((sub = malloc(strlen(path) + strlen(entry->d_name) + 2)) == NULL)
+    {
+      perror("Could not allocate memory :");
+      exit(ERROR_NO_MEM);
+    }
+    sprintf(sub, "%s/%s", path, entry->d_name);
+    if (isDir)
+      addWatches(fd, sub, 0, created);
+    else
+      written(sub);
+    free(sub);
+  }
+  closedir(dp);
+}
+
+static void inotifyEvents(int fd)
+{
+  char buf[64 * 1024] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  char path[PATH_MAX];
+  struct inotify_event *event;
+  ssize_t len;
+  char *ptr;
+
+  while ((len = read(fd, buf, sizeof(buf))) > 0)
+  {
+    for (ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + event->len)
+    {
+      event = (struct inotify_event *)ptr;
+      if (event->mask & IN_Q_OVERFLOW)
+	fprintf(statusStream(), "Too many files written at once, some were missed.  Store their checksums with -s -r.\n");
+      if ((event->wd < 0) || (event->wd >= wdSize) || (wdPath[event->wd] == NULL))
+	continue;
+      if (event->mask & IN_IGNORED)
+      { /* Deleted, or no longer watched */
+	free(wdPath[event->wd]);
+	wdPath[event->wd] = NULL;
+	continue;
+      }
+      if (event->len == 0)
+	snprintf(path, sizeof(path), "%s", wdPath[event->wd]);
+      else
+	snprintf(path, sizeof(path), "%s/%s", wdPath[event->wd], event->name);
+      if (event->mask & IN_ISDIR)
+      {
+	if (watchFlags & RECURSE)
+	  addWatches(fd, path, 0, 1); /* New directory, created or moved here */
+      }
+      else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+	written(path);
+    }
+  }
+}
+
+int watchFiles(char **paths, int count, int flags, int (*stamp)(char *path, int flags))
+{ /* Stamp files in paths as they are written, until interrupted. */
+  struct sigaction action;
+  struct pollfd pfd;
+  int fanotify = 1;
+  int i;
+
+  watchFlags = flags;
+  if ((pfd.fd = initFanotify(paths, count)) == -1)
+  {
+    fanotify = 0;
+    if ((pfd.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1)
+      return ERROR_OPEN_FILE;
+    for (i = 0; i < count; i++)
+      addWatches(pfd.fd, paths[i], 1, 0);
+  }
+  if (flags & VERBOSE)
+    fprintf(statusStream(), "Watching for files being written with %s.\n", fanotify ? "fanotify" : "inotify");
+  fflush(stdout);
+
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = stopWatch; /* No SA_RESTART, so poll() is woken */
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  pfd.events = POLLIN;
+  while (!stopWatching)
+  {
+    /* Wake every second while anything is pending, and to notice a
+     * signal delivered to another thread. */
+    if (poll(&pfd, 1, 1000) > 0)
+    {
+      if (fanotify)
+	fanotifyEvents(pfd.fd);
+      else
+	inotifyEvents(pfd.fd);
+    }
+    if (stampDue(stamp, 0))
+      drainWalk();
+  }
+  /* Don't leave what was written unstamped. */
+  stampDue(stamp, 1);
+  close(pfd.fd);
+  return SUCCESS;
+}
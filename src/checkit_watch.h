@@ -0,0 +1,23 @@
+/*  CHECKIT  
+    A file checksummer and integrity tester 
+    Copyright (C) 2014 Dennis Katsonis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define WATCH_DELAY 5		/* Seconds without writes before a file is stamped */
+#define WATCH_MAX_DELAY 600	/* A file written to all the time is still stamped this often */
+#define WATCH_BUCKETS 4096
+
+int watchFiles(char **paths, int count, int flags, int (*stamp)(char *path, int flags));
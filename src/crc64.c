@@ -38,6 +38,10 @@
  * POSSIBILITY OF SUCH DAMAGE. */
 
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crc64.h"
 
 static const uint64_t crc64_tab[256] = {
     UINT64_C(0x0000000000000000), UINT64_C(0x7ad870c830358979),
@@ -170,7 +174,30 @@ static const uint64_t crc64_tab[256] = {
     UINT64_C(0x536fa08fdfd90e51), UINT64_C(0x29b7d047efec8728),
 };
 
-uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l) {
+/* Slicing tables.  crc64_slice_tab[0] is crc64_tab, and entry k of table n
+ * is the CRC of byte k followed by n zero bytes.  This lets the slicing
+ * kernels fold 8 or 16 input bytes per iteration with independent lookups
+ * instead of one dependent lookup per byte.  Filled in by crc64_init(). */
+static uint64_t crc64_slice_tab[16][256];
+
+/* crc64_xpow8[n] is x^(8 * 2^n) mod P, used to advance a CRC over runs
+ * of zero bytes in logarithmic time.  Filled in by crc64_init(). */
+static uint64_t crc64_xpow8[64];
+
+static uint64_t crc64_bytewise(uint64_t crc, const unsigned char *s, uint64_t l);
+static uint64_t (*crc64_kernel)(uint64_t, const unsigned char *, uint64_t) = crc64_bytewise;
+static const char *crc64_kernel_desc = "bytewise";
+
+/* Little endian load, so the slicing kernels give the same answer
+ * regardless of host byte order or alignment. */
+static inline uint64_t load64le(const unsigned char *p) {
+    return (uint64_t)p[0] | ((uint64_t)p[1] << 8) |
+        ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+        ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) |
+        ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+static uint64_t crc64_bytewise(uint64_t crc, const unsigned char *s, uint64_t l) {
     uint64_t j;
 
     for (j = 0; j < l; j++) {
@@ -180,12 +207,178 @@ uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l) {
     return crc;
 }
 
+static uint64_t crc64_slice8(uint64_t crc, const unsigned char *s, uint64_t l) {
+    const uint64_t (*t)[256] = (const uint64_t (*)[256])crc64_slice_tab;
+
+    while (l >= 8) {
+        crc ^= load64le(s);
+        crc = t[7][crc & 0xff] ^ t[6][(crc >> 8) & 0xff] ^
+            t[5][(crc >> 16) & 0xff] ^ t[4][(crc >> 24) & 0xff] ^
+            t[3][(crc >> 32) & 0xff] ^ t[2][(crc >> 40) & 0xff] ^
+            t[1][(crc >> 48) & 0xff] ^ t[0][crc >> 56];
+        s += 8;
+        l -= 8;
+    }
+    return crc64_bytewise(crc, s, l);
+}
+
+uint64_t crc64_slice16(uint64_t crc, const unsigned char *s, uint64_t l) {
+    const uint64_t (*t)[256] = (const uint64_t (*)[256])crc64_slice_tab;
+    uint64_t hi;
+
+    while (l >= 16) {
+        crc ^= load64le(s);
+        hi = load64le(s + 8);
+        crc = t[15][crc & 0xff] ^ t[14][(crc >> 8) & 0xff] ^
+            t[13][(crc >> 16) & 0xff] ^ t[12][(crc >> 24) & 0xff] ^
+            t[11][(crc >> 32) & 0xff] ^ t[10][(crc >> 40) & 0xff] ^
+            t[9][(crc >> 48) & 0xff] ^ t[8][crc >> 56] ^
+            t[7][hi & 0xff] ^ t[6][(hi >> 8) & 0xff] ^
+            t[5][(hi >> 16) & 0xff] ^ t[4][(hi >> 24) & 0xff] ^
+            t[3][(hi >> 32) & 0xff] ^ t[2][(hi >> 40) & 0xff] ^
+            t[1][(hi >> 48) & 0xff] ^ t[0][hi >> 56];
+        s += 16;
+        l -= 16;
+    }
+    return crc64_slice8(crc, s, l);
+}
+
+/* Polynomial arithmetic modulo P, in the bit reflected form the CRC
+ * register uses (bit 63 is x^0, bit 0 is x^63). */
+static inline uint64_t crc64_mulx(uint64_t a) {
+    return (a >> 1) ^ ((a & 1) ? crc64_tab[128] : 0);
+}
+
+static uint64_t crc64_mulmod(uint64_t a, uint64_t b) {
+    uint64_t r = 0;
+    int i;
+
+    for (i = 63; i >= 0; i--) {
+        if ((a >> i) & 1)
+            r ^= b;
+        b = crc64_mulx(b);
+    }
+    return r;
+}
+
+/* Returns the CRC register after feeding it len zero bytes. */
+uint64_t crc64_shift(uint64_t crc, uint64_t len) {
+    int n;
+
+    for (n = 0; len != 0 && crc != 0; n++, len >>= 1)
+        if (len & 1)
+            crc = crc64_mulmod(crc, crc64_xpow8[n]);
+    return crc;
+}
+
+/* Given crc1 over block A and crc2 over the len2 bytes of block B
+ * (both started from 0), returns the CRC of A followed by B. */
+uint64_t crc64_combine(uint64_t crc1, uint64_t crc2, uint64_t len2) {
+    return crc64_shift(crc1, len2) ^ crc2;
+}
+
+static int crc64_always(void) {
+    return 1;
+}
+
+static const struct {
+    const char *name;
+    uint64_t (*fn)(uint64_t, const unsigned char *, uint64_t);
+    int (*usable)(void);
+} crc64_kernels[] = {
+    { "clmul", crc64_clmul, crc64_clmul_available },
+    { "slice16", crc64_slice16, crc64_always },
+    { "slice8", crc64_slice8, crc64_always },
+    { "bytewise", crc64_bytewise, crc64_always },
+    { NULL, NULL, NULL }
+};
+
+/* Build the slicing tables and choose a kernel.  The fastest kernel this
+ * CPU supports which reproduces the bytewise result is used, unless
+ * CHECKIT_CRC64 names one. */
+void crc64_init(void) {
+    const char *want = getenv("CHECKIT_CRC64");
+    unsigned char crc64_check[200];
+    int i, n;
+
+    for (i = 0; i < (int)sizeof(crc64_check); i++)
+        crc64_check[i] = (unsigned char)("123456789"[i % 9] + i);
+
+    for (i = 0; i < 256; i++)
+        crc64_slice_tab[0][i] = crc64_tab[i];
+    for (n = 1; n < 16; n++)
+        for (i = 0; i < 256; i++)
+            crc64_slice_tab[n][i] = (crc64_slice_tab[n - 1][i] >> 8) ^
+                crc64_tab[crc64_slice_tab[n - 1][i] & 0xff];
+
+    crc64_xpow8[0] = UINT64_C(1) << 63;
+    for (i = 0; i < 8; i++)
+        crc64_xpow8[0] = crc64_mulx(crc64_xpow8[0]);
+    for (n = 1; n < 64; n++)
+        crc64_xpow8[n] = crc64_mulmod(crc64_xpow8[n - 1], crc64_xpow8[n - 1]);
+
+    for (i = 0; crc64_kernels[i].name != NULL; i++) {
+        if (want != NULL && strcmp(want, crc64_kernels[i].name) != 0)
+            continue;
+        if (!crc64_kernels[i].usable())
+            continue;
+        if (crc64_kernels[i].fn(0, crc64_check, sizeof(crc64_check)) !=
+            crc64_bytewise(0, crc64_check, sizeof(crc64_check)))
+            continue;
+        crc64_kernel = crc64_kernels[i].fn;
+        crc64_kernel_desc = crc64_kernels[i].name;
+        return;
+    }
+}
+
+const char *crc64_kernel_name(void) {
+    return crc64_kernel_desc;
+}
+
+uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l) {
+    return crc64_kernel(crc, s, l);
+}
+
 
 #ifdef TEST_MAIN
 #include <stdio.h>
 int main(void) {
+    static unsigned char buf[100003];
+    uint64_t expect;
+    int i, k, kbad, bad = 0;
+
+    crc64_init();
     printf("e9c6d914c4b8d9ca == %016llx\n",
         (unsigned long long) crc64(0,(unsigned char*)"123456789",9));
-    return 0;
+    for (i = 0; i < (int)sizeof(buf); i++)
+        buf[i] = (unsigned char)(i * 2654435761u >> 13);
+    for (k = 0; crc64_kernels[k].name != NULL; k++) {
+        if (!crc64_kernels[k].usable())
+            continue;
+        kbad = 0;
+        for (i = 0; i < 300; i++) {
+            /* Vary both length and alignment. */
+            expect = crc64_bytewise(i, buf + (i % 17), sizeof(buf) - 17 - i * 97);
+            if (crc64_kernels[k].fn(i, buf + (i % 17), sizeof(buf) - 17 - i * 97) != expect)
+                kbad++;
+            expect = crc64_bytewise(~0ULL, buf + i, i);
+            if (crc64_kernels[k].fn(~0ULL, buf + i, i) != expect)
+                kbad++;
+        }
+        printf("%-10s %s\n", crc64_kernels[k].name, kbad ? "FAILED" : "ok");
+        bad += kbad;
+    }
+    kbad = 0;
+    for (i = 0; i < 200; i++) {
+        uint64_t split = (i * 7919) % sizeof(buf);
+        uint64_t a = crc64(0, buf, split);
+        uint64_t b = crc64(0, buf + split, sizeof(buf) - split);
+        if (crc64_combine(a, b, sizeof(buf) - split) != crc64(0, buf, sizeof(buf)))
+            kbad++;
+    }
+    printf("%-10s %s\n", "combine", kbad ? "FAILED" : "ok");
+    bad += kbad;
+    printf("selected: %s\n", crc64_kernel_name());
+    return bad != 0;
 }
 #endif
@@ -18,3 +18,12 @@
 
 static const uint64_t crc64_tab[256];
 uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l);
+void crc64_init(void);
+const char *crc64_kernel_name(void);
+uint64_t crc64_shift(uint64_t crc, uint64_t len);
+uint64_t crc64_combine(uint64_t crc1, uint64_t crc2, uint64_t len2);
+
+/* Individual kernels, for use by the accelerated routines. */
+uint64_t crc64_slice16(uint64_t crc, const unsigned char *s, uint64_t l);
+uint64_t crc64_clmul(uint64_t crc, const unsigned char *s, uint64_t l);
+int crc64_clmul_available(void);
@@ -0,0 +1,132 @@
+/*  CHECKIT  
+    A file checksummer and integrity tester 
+    Copyright (C) 2014 Dennis Katsonis
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* CRC64-Jones using carry-less multiplication (PCLMULQDQ).
+ *
+ * The input is folded 64 bytes at a time into four 128 bit accumulators.
+ * Each fold multiplies the two halves of an accumulator by x^n mod P for
+ * the folding distance, which keeps the result congruent to the data
+ * seen so far.  The last accumulator is handed to the table routine,
+ * which does the final reduction to 64 bits along with any tail bytes.
+ *
+ * Everything here is built with a target attribute, so no special
+ * compiler flags are required and the binary still runs on CPUs without
+ * PCLMULQDQ.  crc64_init() only selects it if the CPU supports it. */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "crc64.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+
+#include <immintrin.h>
+
+#define CRC64_POLY_REV UINT64_C(0x95ac9329ac4bc9b5)
+
+static uint64_t fold128[2];	/* x^191, x^127 mod P, bit reflected */
+static uint64_t fold512[2];	/* x^575, x^511 mod P, bit reflected */
+
+static uint64_t xpow_mod(int n)
+{ /* x^n mod P in the same reflected form the CRC register uses. */
+  uint64_t r = UINT64_C(1) << 63;
+
+  while (n--)
+    r = (r >> 1) ^ ((r & 1) ? CRC64_POLY_REV : 0);
+  return r;
+}
+
+int crc64_clmul_available(void)
+{
+  __builtin_cpu_init();
+  if (!__builtin_cpu_supports("pclmul"))
+    return 0;
+
+  fold128[0] = xpow_mod(128 + 63);
+  fold128[1] = xpow_mod(128 - 1);
+  fold512[0] = xpow_mod(512 + 63);
+  fold512[1] = xpow_mod(512 - 1);
+  return 1;
+}
+
+__attribute__((target("pclmul,sse2")))
+static inline __m128i fold(__m128i acc, __m128i k, __m128i next)
+{
+  __m128i lead = _mm_clmulepi64_si128(acc, k, 0x00); /* First 8 bytes */
+  __m128i trail = _mm_clmulepi64_si128(acc, k, 0x11);
+
+  return _mm_xor_si128(_mm_xor_si128(lead, trail), next);
+}
+
+__attribute__((target("pclmul,sse2")))
+uint64_t crc64_clmul(uint64_t crc, const unsigned char *s, uint64_t l)
+{
+  __m128i x0, x1, x2, x3, k;
+  unsigned char last[16];
+
+  if (l < 64)
+    return crc64_slice16(crc, s, l);
+
+  x0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)s),
+		     _mm_cvtsi64_si128((long long)crc));
+  x1 = _mm_loadu_si128((const __m128i *)(s + 16));
+  x2 = _mm_loadu_si128((const __m128i *)(s + 32));
+  x3 = _mm_loadu_si128((const __m128i *)(s + 48));
+  s += 64;
+  l -= 64;
+
+  k = _mm_set_epi64x((long long)fold512[1], (long long)fold512[0]);
+  while (l >= 64)
+  {
+    x0 = fold(x0, k, _mm_loadu_si128((const __m128i *)s));
+    x1 = fold(x1, k, _mm_loadu_si128((const __m128i *)(s + 16)));
+    x2 = fold(x2, k, _mm_loadu_si128((const __m128i *)(s + 32)));
+    x3 = fold(x3, k, _mm_loadu_si128((const __m128i *)(s + 48)));
+    s += 64;
+    l -= 64;
+  }
+
+  k = _mm_set_epi64x((long long)fold128[1], (long long)fold128[0]);
+  x1 = fold(x0, k, x1);
+  x2 = fold(x1, k, x2);
+  x3 = fold(x2, k, x3);
+  while (l >= 16)
+  {
+    x3 = fold(x3, k, _mm_loadu_si128((const __m128i *)s));
+    s += 16;
+    l -= 16;
+  }
+
+  _mm_storeu_si128((__m128i *)last, x3);
+  crc = crc64_slice16(0, last, 16);
+  return crc64_slice16(crc, s, l);
+}
+
+#else /* No carry-less multiply support for this target. */
+
+int crc64_clmul_available(void)
+{
+  return 0;
+}
+
+uint64_t crc64_clmul(uint64_t crc, const unsigned char *s, uint64_t l)
+{
+  return crc64_slice16(crc, s, l);
+}
+
+#endif
@@ -64,6 +64,10 @@
 #define BTRFS_TEST_MAGIC        0x73727279
 /* Constant that identifies the `cgroup' filesystem.  */
 #define CGROUP_SUPER_MAGIC        0x27e0eb
+/* Constant that identifies the `ceph' filesystem.  */
+#define CEPH_SUPER_MAGIC        0x00c36400
+/* Constant that identifies the `cifs' filesystem.  */
+#define CIFS_MAGIC_NUMBER        0xff534d42
 /* Constant that identifies the `coda' filesystem.  */
 #define CODA_SUPER_MAGIC        0x73757245
 /* Constant that identifies the `coherent' filesystem.  */
@@ -93,6 +97,8 @@
 #define EXT4_SUPER_MAGIC        0xef53
 /* Constant that identifies the `f2fs' filesystem.  */
 #define F2FS_SUPER_MAGIC        0xf2f52010
+/* Constant that identifies the `fuse' filesystem.  */
+#define FUSE_SUPER_MAGIC        0x65735546
 /* Constant that identifies the `futexfs' filesystem.  */
 #define FUTEXFS_SUPER_MAGIC        0xBAD1DEA
 /* Constant that identifies the `hostfs' filesystem.  */
@@ -166,6 +172,8 @@
 #define SMB_SUPER_MAGIC                0x517b
 /* Constant that identifies the `sockfs' filesystem.  */
 #define SOCKFS_MAGIC                0x534F434B
+/* Constant that identifies the `smb2' filesystem.  */
+#define SMB2_MAGIC_NUMBER        0xfe534d42
 /* Constant that identifies the `squashfs' filesystem.  */
 #define SQUASHFS_MAGIC                0x73717368
 /* Constant that identifies the end of stacks allocated by the kernel.  */
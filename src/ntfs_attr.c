@@ -34,27 +34,20 @@ least with NTFS-3G so this probably won't be necessary in most cases.*/
 
 #define FILE_ATTRIBUTE_HIDDEN 0x2
 
-int ntfs_attr(const char *file)
-{
-  int fd;
+int ntfs_attr(int fd)
+{ /* fd must be an open descriptor for the file to hide. */
   int32_t checksum_attr;
   int attr_len = sizeof(int32_t);
   
-  if ((fd = open(file, O_WRONLY)) == -1)
-    return 1;
-  
-  if ((getxattr(file, "system.ntfs_attrib", (char *)&checksum_attr, sizeof(int32_t))) == -1)
+  if ((fgetxattr(fd, "system.ntfs_attrib", (char *)&checksum_attr, sizeof(int32_t))) == -1)
   {
-    close(fd);
     return 1;
   }
   checksum_attr |= FILE_ATTRIBUTE_HIDDEN;
   
-  if ((setxattr(file, "system.ntfs_attrib", (const char *)&checksum_attr, sizeof(attr_len), XATTR_REPLACE)) == -1)
+  if ((fsetxattr(fd, "system.ntfs_attrib", (const char *)&checksum_attr, sizeof(attr_len), XATTR_REPLACE)) == -1)
   {
-    close(fd);
     return 1;
   }
-  close(fd);
   return 0;
 }
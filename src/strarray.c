@@ -16,81 +16,330 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+/* Lists of files, with why each is listed.
+ *
+ * Records are packed into an arena that doubles as it fills, up to a
+ * limit.  Past that, the arena is written to a temporary file as a run
+ * (sorted first, if the list is to be printed sorted) and started
+ * again.  Printing a sorted list merges the runs. */
+
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
 #include "strarray.h"
 #include "checkit.h"
 
-const int chunkSize = 4096;
+#define RUN_BUFFER (64 * 1024) /* Read from each spilled run at a time */
+
+typedef struct {
+  int fd;
+  off_t pos;		/* Next to read */
+  off_t end;
+  char *buf;
+  size_t start;		/* Next record in buf */
+  size_t len;		/* Bytes in buf */
+  size_t size;
+  const char *record;	/* Current record, NULL at the end of the run */
+} runReader;
+
+static int listOrder;	/* For qsort() */
 
-int initFileList(fileList *list)
+static const char *recordReason(const char *record)
 {
-  list->files = malloc(chunkSize);
-  if (list->files == NULL)
+  return record + strlen(record) + 1;
+}
+
+static size_t recordSize(const char *record)
+{
+  const char *reason = recordReason(record);
+
+  return reason + strlen(reason) + 1 - record;
+}
+
+static int compareRecords(const char *a, const char *b)
+{ /* By directory first, if grouping by it, then the whole path. */
+  const char *slashA, *slashB;
+  size_t dirA, dirB;
+  int cmp;
+
+  if (listOrder == LIST_BY_DIRECTORY)
   {
-    return ERROR_NO_MEM;
+    slashA = strrchr(a, '/');
+    slashB = strrchr(b, '/');
+    dirA = slashA ? slashA - a : 0;
+    dirB = slashB ? slashB - b : 0;
+    if ((cmp = memcmp(a, b, (dirA < dirB) ? dirA : dirB)) != 0)
+      return cmp;
+    if (dirA != dirB)
+      return (dirA > dirB) - (dirA < dirB);
   }
-  list->freeSpace = chunkSize;
-  list->size = chunkSize;
-  list->ptr = list->files;
+  return strcmp(a, b);
+}
+
+static int compareIndex(const void *a, const void *b)
+{
+  return compareRecords(*(const char * const *)a, *(const char * const *)b);
+}
+
+static const char **sortArena(fileList *list, size_t *count)
+{ /* Pointers to the records in memory, in the order to print them. */
+  const char **index;
+  size_t n = 0, i, pos;
+
+  for (pos = 0; pos < list->used; pos += recordSize(list->arena + pos))
+    ++n;
+  if ((index = malloc((n ? n : 1) * sizeof(char *))) == NULL)
+    return NULL;
+  for (pos = 0, i = 0; pos < list->used; pos += recordSize(list->arena + pos))
+    index[i++] = list->arena + pos;
+  if (list->order != LIST_FOUND)
+  {
+    listOrder = list->order;
+    qsort(index, n, sizeof(char *), compareIndex);
+  }
+  *count = n;
+  return index;
+}
+
+static int spillArena(fileList *list)
+{ /* Write what is in memory out as a run, and empty the arena. */
+  const char **index;
+  fileListRun *runs;
+  size_t n, i;
+
+  if (list->used == 0)
+    return SUCCESS;
+  if ((list->spill == NULL) && ((list->spill = tmpfile()) == NULL))
+    return ERROR_WRITE_FILE;
+  if ((runs = realloc(list->runs, (list->nruns + 1) * sizeof(fileListRun))) == NULL)
+    return ERROR_NO_MEM;
+  list->runs = runs;
+  if ((index = sortArena(list, &n)) == NULL)
+    return ERROR_NO_MEM;
+  fseeko(list->spill, 0, SEEK_END);
+  runs[list->nruns].start = ftello(list->spill);
+  for (i = 0; i < n; i++)
+    fwrite(index[i], recordSize(index[i]), 1, list->spill);
+  free(index);
+  if (fflush(list->spill) != 0)
+    return ERROR_WRITE_FILE;
+  runs[list->nruns].length = ftello(list->spill) - runs[list->nruns].start;
+  ++list->nruns;
+  list->used = 0;
   return SUCCESS;
 }
 
-int appendFileList(fileList *list, const char *basename, const char *filename)
+int fileListOrderByName(const char *name)
 {
-  int strlenBasename = strlen(basename);
-  int strSize = (strlenBasename + strlen(filename) + 1); /* +1 for the "\n" we add to the end. */
+  if (strcmp(name, "found") == 0)
+    return LIST_FOUND;
+  if (strcmp(name, "sorted") == 0)
+    return LIST_SORTED;
+  if (strcmp(name, "dir") == 0)
+    return LIST_BY_DIRECTORY;
+  return -1;
+}
 
-  if (list->files == NULL)
+int initFileList(fileList *list, int order, size_t limit)
+{
+  list->size = FILE_LIST_CHUNK;
+  list->arena = malloc(list->size);
+  list->used = 0;
+  list->limit = (limit > FILE_LIST_CHUNK) ? limit : FILE_LIST_CHUNK;
+  list->order = order;
+  list->spill = NULL;
+  list->runs = NULL;
+  list->nruns = 0;
+  return (list->arena == NULL) ? ERROR_NO_MEM : SUCCESS;
+}
+
+int appendFileList(fileList *list, const char *path, const char *reason)
+{
+  size_t pathLen = strlen(path) + 1;
+  size_t reasonLen = strlen(reason) + 1;
+  size_t need = list->used + pathLen + reasonLen;
+  size_t size;
+  char *arena;
+  int result;
+
+  if (list->arena == NULL)
     return ERROR_NO_MEM;
-  
-  if (list->freeSpace <= (strSize + 4))
+  if (need > list->size)
   {
-    
-    /* Save ptr offset */
-    size_t offset = list->ptr - list->files;
-    
-    list->files = realloc(list->files, list->size + chunkSize);
-    if (list->files == NULL)
+    if ((need > list->limit) && (list->used > 0))
     {
-      return ERROR_NO_MEM;
+      if ((result = spillArena(list)) != SUCCESS)
+	return result;
+      need = pathLen + reasonLen;
+    }
+    for (size = list->size; size < need; size *= 2)
+      ;
+    if (size > list->size)
+    { /* A record bigger than the limit still has to fit. */
+      if ((size > list->limit) && (list->limit >= need))
+	size = list->limit;
+      if ((arena = realloc(list->arena, size)) == NULL)
+	return ERROR_NO_MEM;
+      list->arena = arena;
+      list->size = size;
+    }
+  }
+  memcpy(list->arena + list->used, path, pathLen);
+  memcpy(list->arena + list->used + pathLen, reason, reasonLen);
+  list->used += pathLen + reasonLen;
+  return SUCCESS;
+}
+
+static void nextRecord(runReader *run)
+{ /* Step to the next record of a spilled run. */
+  const char *end;
+  ssize_t got;
+  char *buf;
+
+  for (;;)
+  {
+    /* A whole record is two strings. */
+    end = memchr(run->buf + run->start, 0, run->len - run->start);
+    if (end != NULL)
+      end = memchr(end + 1, 0, run->buf + run->len - (end + 1));
+    if (end != NULL)
+    {
+      run->record = run->buf + run->start;
+      run->start = end + 1 - run->buf;
+      return;
+    }
+    if (run->pos >= run->end)
+    {
+      run->record = NULL;
+      return;
+    }
+    /* Keep the partial record, and read more after it. */
+    memmove(run->buf, run->buf + run->start, run->len - run->start);
+    run->len -= run->start;
+    run->start = 0;
+    if (run->len == run->size)
+    {
+      if ((buf = realloc(run->buf, run->size * 2)) == NULL)
+      {
+	run->record = NULL;
+	return;
+      }
+      run->buf = buf;
+      run->size *= 2;
+    }
+    got = pread(run->fd, run->buf + run->len,
+		((off_t)(run->size - run->len) < run->end - run->pos) ? (off_t)(run->size - run->len) : run->end - run->pos,
+		run->pos);
+    if (got <= 0)
+    {
+      run->record = NULL;
+      return;
     }
-    
-    list->size+=chunkSize;
-    list->freeSpace+=chunkSize;
-    /* Restore ptr offset 
-     The ptr offset avoid having to scan the entire string
-     for the terminating null on each call of strlen */
-    list->ptr = list->files;
-    list->ptr += offset;
+    run->pos += got;
+    run->len += got;
   }
-  if (strlenBasename)
+}
+
+static void printRecord(FILE *out, const char *record, const char *reason, int order, char **lastDir)
+{ /* With the reason, unless the list is of one reason.  Grouped by
+   * directory, each directory is printed when it changes. */
+  const char *slash = strrchr(record, '/');
+  size_t dirLen = slash ? slash + 1 - record : 0;
+
+  if (order == LIST_BY_DIRECTORY)
   {
-    strcat(list->ptr, basename);
+    if ((*lastDir == NULL) || (strlen(*lastDir) != dirLen) || (strncmp(*lastDir, record, dirLen) != 0))
+    {
+      free(*lastDir);
+      if ((*lastDir = strndup(record, dirLen)) == NULL)
+	return;
+      fprintf(out, "%s\n", dirLen ? *lastDir : "./");
+    }
+    fprintf(out, "  %s", record + dirLen);
+  }
+  else
+    fputs(record, out);
+  if (reason == NULL)
+    fprintf(out, "\t%s", recordReason(record));
+  putc('\n', out);
+}
+
+int printFileList(FILE *out, fileList *list, const char *reason)
+{ /* Print the files listed for reason, or all of them if NULL. */
+  runReader *run;
+  const char **index;
+  const char *record;
+  char *lastDir = NULL;
+  size_t n, i;
+  int r, best;
+
+  if (list->spill == NULL)
+  { /* It all fitted in memory. */
+    if ((index = sortArena(list, &n)) == NULL)
+      return ERROR_NO_MEM;
+    for (i = 0; i < n; i++)
+      if ((reason == NULL) || (strcmp(recordReason(index[i]), reason) == 0))
+	printRecord(out, index[i], reason, list->order, &lastDir);
+    free(index);
+    free(lastDir);
+    return SUCCESS;
   }
-  strcat(list->ptr, filename);
-  strcat(list->ptr, "\n");
-  list->ptr+=strSize;
-  list->freeSpace-= (strSize + strlenBasename - 1);
 
+  if ((r = spillArena(list)) != SUCCESS)
+    return r;
+  if ((run = calloc(list->nruns, sizeof(runReader))) == NULL)
+    return ERROR_NO_MEM;
+  for (r = 0; r < list->nruns; r++)
+  {
+    run[r].fd = fileno(list->spill);
+    run[r].pos = list->runs[r].start;
+    run[r].end = list->runs[r].start + list->runs[r].length;
+    run[r].size = RUN_BUFFER;
+    if ((run[r].buf = malloc(RUN_BUFFER)) == NULL)
+      break;
+    nextRecord(&run[r]);
+  }
+  /* Runs are in the order they were added, so for that order just read
+   * them one after another.  Otherwise take the least of their heads. */
+  listOrder = list->order;
+  for (;;)
+  {
+    best = -1;
+    for (r = 0; r < list->nruns; r++)
+    {
+      if ((run[r].buf == NULL) || (run[r].record == NULL))
+	continue;
+      if (best == -1)
+	best = r;
+      if (list->order == LIST_FOUND)
+	break;
+      if (compareRecords(run[r].record, run[best].record) < 0)
+	best = r;
+    }
+    if (best == -1)
+      break;
+    record = run[best].record;
+    if ((reason == NULL) || (strcmp(recordReason(record), reason) == 0))
+      printRecord(out, record, reason, list->order, &lastDir);
+    nextRecord(&run[best]);
+  }
+  for (r = 0; r < list->nruns; r++)
+    free(run[r].buf);
+  free(run);
+  free(lastDir);
   return SUCCESS;
 }
 
 void freeFileList(fileList *list)
 {
-  list->ptr = NULL;
-  list->freeSpace = 0;
-  list->size = 0;
-  if (list->files != NULL)
-    free(list->files);
-  list->files = NULL;
-}
-
-const char *getFileList(const fileList *list)
-{
-  if (list->files != NULL)
-    return list->files;
-  else
-    return NULL;
+  free(list->arena);
+  list->arena = NULL;
+  list->used = list->size = 0;
+  if (list->spill != NULL)
+    fclose(list->spill);
+  list->spill = NULL;
+  free(list->runs);
+  list->runs = NULL;
+  list->nruns = 0;
 }
@@ -16,15 +16,37 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <stdio.h>
+#include <sys/types.h>
+
+#define FILE_LIST_MEMORY (64 * 1024 * 1024) /* Held in memory before spilling to a file */
+#define FILE_LIST_CHUNK 4096 /* Arena to start with */
+
+enum fileListOrders
+{
+  LIST_FOUND,		/* In the order they were added */
+  LIST_SORTED,		/* By path */
+  LIST_BY_DIRECTORY	/* By directory, each printed once with its files under it */
+};
+
 typedef struct {
-  char *files;
-  char *ptr;
-  int freeSpace;
-  int size;
-} fileList;
+  off_t start;
+  off_t length;
+} fileListRun;		/* Records spilled at once, in order */
 
+typedef struct {
+  char *arena;		/* Records, each a path and a reason, NUL terminated */
+  size_t used;
+  size_t size;
+  size_t limit;		/* Most to hold in memory */
+  int order;
+  FILE *spill;		/* Temporary file for what didn't fit, NULL if all did */
+  fileListRun *runs;
+  int nruns;
+} fileList;
 
-int initFileList(fileList *list);
-int appendFileList(fileList *list, const char *basename, const char *filename);
-const char *getFileList(const fileList *list);
+int fileListOrderByName(const char *name);
+int initFileList(fileList *list, int order, size_t limit);
+int appendFileList(fileList *list, const char *path, const char *reason);
+int printFileList(FILE *out, fileList *list, const char *reason);
 void freeFileList(fileList *list);